@@ -0,0 +1,2953 @@
+#ifndef IMMUTABLE_TEXT_H
+#define IMMUTABLE_TEXT_H
+
+#include<string.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// <summary>
+// Holds the block shift picking the primitive leaf size (BLOCK_SIZE
+// characters per leaf). A compile-time constant so the leaf stores, pool
+// slot sizes and merge thresholds all specialize to it; override it per
+// build (-DIMMUTABLE_TEXT_BLOCK_SHIFT=10 for bulk-document workloads) to
+// trade tree depth and per-node overhead against leaf copy cost.
+// </summary>
+#ifndef IMMUTABLE_TEXT_BLOCK_SHIFT
+#define IMMUTABLE_TEXT_BLOCK_SHIFT 6
+#endif
+
+// <summary>Holds the size for primitive blocks of characters.</summary>
+const int BLOCK_SIZE = 1 << IMMUTABLE_TEXT_BLOCK_SHIFT;
+
+/// <summary>Holds the mask used to ensure a block boundary cesures.</summary>
+const int BLOCK_MASK = ~(BLOCK_SIZE - 1);
+
+/// <summary>Holds the number of slots carved out of each slab of a node pool.</summary>
+const int POOL_SLAB_SLOTS = 1024;
+
+/// <summary>Holds the number of slots a thread hands back to its pool in one push.</summary>
+const int POOL_REMOTE_BATCH = 64;
+
+/// <summary>Holds the number of node pools a process may create; one per node class.</summary>
+const int POOL_CLASS_LIMIT = 16;
+
+/// <summary>Holds the input size below which tree construction stays single-threaded.</summary>
+const int PARALLEL_CHUNK_CUTOFF = 1 << 20;
+
+/// <summary>Holds the capacity of the small leaves serving keystroke-sized texts.</summary>
+const int SMALL_LEAF_SIZE = 16;
+
+/// <summary>Holds the multiplier of the polynomial content hash (the 64-bit FNV prime).</summary>
+const unsigned long long HASH_BASE = 0x100000001b3ULL;
+
+// Define IMMUTABLE_TEXT_STATS to compile in the telemetry layer: relaxed
+// global counters probed from the allocator, ConcatNodes, NodeOf,
+// EnsureChunked and FindLeaf, snapshotted through TextStats at the bottom
+// of this header. Without the define every probe expands to nothing.
+#ifdef IMMUTABLE_TEXT_STATS
+
+/// <summary>Global event counters behind the probes; see TextStats.</summary>
+struct TextStatsCounters
+{
+	atomic<long long> concatCalls;
+	atomic<long long> leafMerges;
+	atomic<long long> nodeOfCalls;
+	atomic<long long> fullRebuilds;
+	atomic<long long> rebalances;
+	atomic<long long> findLeafDescents;
+	atomic<long long> findLeafSteps;
+	atomic<long long> leafCacheHits;
+	atomic<long long> poolAllocates;
+	atomic<long long> poolFrees;
+	atomic<long long> slotBytesAllocated;
+	atomic<long long> slotBytesFreed;
+};
+
+inline TextStatsCounters textStatsCounters;
+
+#define TEXT_STATS_COUNT(field) textStatsCounters.field.fetch_add(1, memory_order_relaxed)
+#define TEXT_STATS_ADD(field, amount) textStatsCounters.field.fetch_add(amount, memory_order_relaxed)
+
+#else
+
+#define TEXT_STATS_COUNT(field) ((void)0)
+#define TEXT_STATS_ADD(field, amount) ((void)0)
+
+#endif // IMMUTABLE_TEXT_STATS
+
+/// <summary>
+/// Multiplies a polynomial hash by HASH_BASE^length in O(log length), the
+/// step that lets a composite derive its hash from its children's instead
+/// of rehashing their characters: hash(head + tail) =
+/// HashShift(hash(head), |tail|) + hash(tail). Content-equal texts hash
+/// equal no matter how their trees are shaped.
+/// </summary>
+inline unsigned long long HashShift(unsigned long long hash, int length)
+{
+	unsigned long long power = HASH_BASE;
+	while (length > 0) {
+		if ((length & 1) != 0)
+			hash *= power;
+		power *= power;
+		length >>= 1;
+	}
+	return hash;
+}
+
+/// <summary>
+/// Slab allocator with a single fixed slot size. Slots are carved out of
+/// large slabs and recycled through per-thread free lists, so node
+/// allocation and release are an unsynchronized pointer pop/push. A thread
+/// that accumulates too many frees - a worker releasing an old snapshot
+/// while the owner edits - hands slots back through a lock-free remote
+/// stack in batches, so cross-thread reclamation never contends on a
+/// mutex with an allocation burst. Slabs themselves are only reclaimed in
+/// bulk when the pool is destroyed.
+/// </summary>
+class Pool
+{
+private:
+	struct FreeSlot { FreeSlot* next; };
+	struct Slab { Slab* next; };
+
+	/// <summary>One thread's private free list for one pool; flushed to the
+	/// pool's remote stack when the thread exits.</summary>
+	struct ThreadCache
+	{
+		FreeSlot* list;
+		int count;
+		Pool* owner;
+
+		ThreadCache()
+		{
+			list = 0;
+			count = 0;
+			owner = 0;
+		}
+
+		~ThreadCache()
+		{
+			if (owner != 0 && list != 0) {
+				FreeSlot* tail = list;
+				while (tail->next != 0)
+					tail = tail->next;
+				owner->PushRemote(list, tail);
+			}
+		}
+	};
+
+	int slotSize;
+	// Index into each thread's cache array, assigned at construction.
+	int index;
+	// Treiber stack of slot chains freed by other threads. Pushes link a
+	// whole batch with one CAS; refills take the entire stack with one
+	// exchange, so the pop side has no ABA window.
+	atomic<FreeSlot*> remote;
+	Slab* slabs;
+	// Guards slab growth only; the hot paths never take it.
+	mutex slabLock;
+	atomic<long long> allocations;
+
+	static atomic<int> poolCount;
+
+	/// <summary>Returns the calling thread's cache for this pool.</summary>
+	ThreadCache& Cache()
+	{
+		static thread_local ThreadCache caches[POOL_CLASS_LIMIT];
+		ThreadCache& cache = caches[index];
+		cache.owner = this;
+		return cache;
+	}
+
+	/// <summary>Links a chain of freed slots onto the remote stack.</summary>
+	void PushRemote(FreeSlot* head, FreeSlot* tail)
+	{
+		FreeSlot* top = remote.load(memory_order_relaxed);
+		do {
+			tail->next = top;
+		} while (!remote.compare_exchange_weak(top, head, memory_order_release, memory_order_relaxed));
+	}
+
+	/// <summary>Restocks an empty cache from the remote stack, or from a new slab.</summary>
+	void Refill(ThreadCache& cache)
+	{
+		FreeSlot* chain = remote.exchange(0, memory_order_acquire);
+		if (chain != 0) {
+			cache.list = chain;
+			for (; chain != 0; chain = chain->next)
+				cache.count++;
+			return;
+		}
+		char* block = new char[sizeof(Slab) + slotSize * POOL_SLAB_SLOTS];
+		Slab* slab = (Slab*)block;
+		{
+			lock_guard<mutex> guard(slabLock);
+			slab->next = slabs;
+			slabs = slab;
+		}
+		char* slots = block + sizeof(Slab);
+		for (int i = 0; i < POOL_SLAB_SLOTS; i++) {
+			FreeSlot* slot = (FreeSlot*)(slots + i * slotSize);
+			slot->next = cache.list;
+			cache.list = slot;
+		}
+		cache.count += POOL_SLAB_SLOTS;
+	}
+
+public:
+	Pool(int slotSize)
+	{
+		this->slotSize = slotSize;
+		this->index = poolCount.fetch_add(1, memory_order_relaxed);
+		this->remote = 0;
+		this->slabs = 0;
+		this->allocations = 0;
+	}
+
+	~Pool()
+	{
+		while (slabs != 0) {
+			Slab* next = slabs->next;
+			delete [] (char*)slabs;
+			slabs = next;
+		}
+	}
+
+	void* Allocate()
+	{
+		ThreadCache& cache = Cache();
+		if (cache.list == 0)
+			Refill(cache);
+		FreeSlot* slot = cache.list;
+		cache.list = slot->next;
+		cache.count--;
+		allocations.fetch_add(1, memory_order_relaxed);
+		TEXT_STATS_COUNT(poolAllocates);
+		TEXT_STATS_ADD(slotBytesAllocated, slotSize);
+		return slot;
+	}
+
+	void Free(void* block)
+	{
+		TEXT_STATS_COUNT(poolFrees);
+		TEXT_STATS_ADD(slotBytesFreed, slotSize);
+		ThreadCache& cache = Cache();
+		FreeSlot* slot = (FreeSlot*)block;
+		slot->next = cache.list;
+		cache.list = slot;
+		if (++cache.count < 2 * POOL_REMOTE_BATCH)
+			return;
+		// Hand half the surplus back so a release-only thread does not
+		// hoard slots the allocating thread will need again.
+		FreeSlot* tail = cache.list;
+		for (int i = 1; i < POOL_REMOTE_BATCH; i++)
+			tail = tail->next;
+		FreeSlot* rest = tail->next;
+		tail->next = 0;
+		PushRemote(cache.list, tail);
+		cache.list = rest;
+		cache.count -= POOL_REMOTE_BATCH;
+	}
+
+	/// <summary>Returns how many slots this pool has handed out since start-up.</summary>
+	long long Allocations()
+	{
+		return allocations.load(memory_order_relaxed);
+	}
+};
+
+inline atomic<int> Pool::poolCount (0);
+
+/// <summary>Discriminates the concrete node type without an RTTI lookup.</summary>
+enum NodeKind : char {
+	LEAF_NODE,
+	BYTE_LEAF_NODE,
+	MAPPED_LEAF_NODE,
+	SLICE_NODE,
+	COMPOSITE_NODE
+};
+
+class Node {
+private:
+	// Atomic so snapshots can be retained and released from background
+	// threads while the owner keeps editing.
+	atomic<int> refs;
+	NodeKind kind;
+public:
+		Node(NodeKind kind)
+		{
+			this->refs = 1;
+			this->kind = kind;
+		}
+
+		/// <summary>Tells whether this node is a CompositeNode; a byte load instead of a typeid comparison.</summary>
+		bool IsComposite()
+		{
+			return kind == COMPOSITE_NODE;
+		}
+
+		NodeKind Kind()
+		{
+			return kind;
+		}
+
+		virtual ~Node() {}
+
+		virtual int Length() = 0;
+		virtual Node* SubNode(int start, int end) = 0;
+		virtual wchar_t GetCharAt(int index) = 0;
+		virtual void CopyTo (int sourceIndex, wchar_t* destination, int destinationIndex, int count) = 0;
+		virtual int Newlines() = 0;
+		virtual unsigned long long Hash() = 0;
+
+		/// <summary>Adds a reference; every snapshot sharing this subtree holds one.</summary>
+		void Retain()
+		{
+			refs.fetch_add(1, memory_order_relaxed);
+		}
+
+		/// <summary>Drops a reference and frees the node once the last snapshot lets go of it.</summary>
+		void Release()
+		{
+			if (refs.fetch_sub(1, memory_order_acq_rel) == 1)
+				delete this;
+		}
+};
+
+class WideLeafNode : public Node
+{
+private:
+	int size;
+	const wchar_t* data;
+	// Cached newline count, -1 until first asked for. Nodes are immutable,
+	// so the count never invalidates; racing recomputations store the same
+	// value, hence the relaxed atomic.
+	atomic<int> newlines;
+	// Cached content hash, 0 until first asked for; a true hash of 0 is
+	// simply recomputed on every call, which is harmless and vanishingly rare.
+	atomic<unsigned long long> contentHash;
+
+	/// <summary>Returns the character store that trails the node inside its pool slot.</summary>
+	wchar_t* InlineData()
+	{
+		return (wchar_t*)(this + 1);
+	}
+
+public:
+	/// <summary>Holds the pool all leaves live in; each slot fits the node plus a BLOCK_SIZE character store.</summary>
+	static Pool pool;
+
+	static void* operator new(size_t)
+	{
+		return pool.Allocate();
+	}
+
+	static void operator delete(void* block)
+	{
+		pool.Free(block);
+	}
+
+	WideLeafNode(int size) : Node(LEAF_NODE)
+	{
+		this->size = size;
+		this->data = size <= BLOCK_SIZE ? InlineData() : new wchar_t[size];
+		this->newlines = -1;
+		this->contentHash = 0;
+	}
+
+	int Newlines()
+	{
+		int cached = newlines.load(memory_order_relaxed);
+		if (cached >= 0)
+			return cached;
+		int count = 0;
+		for (int i = 0; i < size; i++)
+			if (data[i] == L'\n')
+				count++;
+		newlines.store(count, memory_order_relaxed);
+		return count;
+	}
+
+	unsigned long long Hash()
+	{
+		unsigned long long cached = contentHash.load(memory_order_relaxed);
+		if (cached != 0)
+			return cached;
+		unsigned long long hash = 0;
+		for (int i = 0; i < size; i++)
+			hash = hash * HASH_BASE + data[i];
+		contentHash.store(hash, memory_order_relaxed);
+		return hash;
+	}
+
+	/// <summary>Returns the mutable character store; only write to it while the leaf is being filled.</summary>
+	wchar_t* WritableData()
+	{
+		return (wchar_t*)data;
+	}
+
+	int Length() {
+		return size;
+	}
+
+	virtual Node* SubNode(int start, int end);
+
+	wchar_t GetCharAt(int index)
+	{
+		return *(data + index);
+	}
+
+	/// <summary>Returns the contiguous character span backing this leaf.</summary>
+	const wchar_t* Data()
+	{
+		return data;
+	}
+
+	void CopyTo (int sourceIndex, wchar_t* destination, int destinationIndex, int count) {
+		// memcpy lets the compiler pick the widest copy the target supports
+		// (SSE2/AVX2 on x86) instead of moving one wchar_t per iteration.
+		memcpy(destination + destinationIndex, data + sourceIndex, count * sizeof(wchar_t));
+	}
+
+	~WideLeafNode()
+	{
+		if (size > BLOCK_SIZE)
+			delete [] data;
+	}
+};
+
+inline Pool WideLeafNode::pool (sizeof(WideLeafNode) + BLOCK_SIZE * sizeof(wchar_t));
+
+/// <summary>
+/// Wide leaf for texts of at most SMALL_LEAF_SIZE characters. Identical to
+/// its base in layout and kind - the store still trails the node - but the
+/// pool slot is sized for 16 characters instead of a full block, so the
+/// 1-10 character texts every keystroke inserts stop costing a block-sized
+/// slot each. The virtual destructor routes deletion to the right pool.
+/// </summary>
+class SmallWideLeafNode : public WideLeafNode
+{
+public:
+	/// <summary>Holds the pool all small wide leaves live in.</summary>
+	static Pool pool;
+
+	static void* operator new(size_t)
+	{
+		return pool.Allocate();
+	}
+
+	static void operator delete(void* block)
+	{
+		pool.Free(block);
+	}
+
+	SmallWideLeafNode(int size) : WideLeafNode(size)
+	{
+	}
+};
+
+inline Pool SmallWideLeafNode::pool (sizeof(SmallWideLeafNode) + SMALL_LEAF_SIZE * sizeof(wchar_t));
+
+/// <summary>
+/// Leaf storing Latin-1 characters in one byte each, the way JetBrains'
+/// version does. Since almost all source text is ASCII this cuts leaf
+/// memory 4x against wchar_t and quadruples cache density for scans;
+/// characters are widened at the CopyTo/GetCharAt boundary.
+/// </summary>
+class ByteLeafNode : public Node
+{
+private:
+	int size;
+	const unsigned char* data;
+	// Cached newline count, -1 until first asked for; see WideLeafNode.
+	atomic<int> newlines;
+	// Cached content hash, 0 until first asked for; see WideLeafNode.
+	atomic<unsigned long long> contentHash;
+
+	/// <summary>Returns the byte store that trails the node inside its pool slot.</summary>
+	unsigned char* InlineData()
+	{
+		return (unsigned char*)(this + 1);
+	}
+
+public:
+	/// <summary>Holds the pool all byte leaves live in; each slot fits the node plus a BLOCK_SIZE byte store.</summary>
+	static Pool pool;
+
+	static void* operator new(size_t)
+	{
+		return pool.Allocate();
+	}
+
+	static void operator delete(void* block)
+	{
+		pool.Free(block);
+	}
+
+	ByteLeafNode(int size) : Node(BYTE_LEAF_NODE)
+	{
+		this->size = size;
+		this->data = size <= BLOCK_SIZE ? InlineData() : new unsigned char[size];
+		this->newlines = -1;
+		this->contentHash = 0;
+	}
+
+	int Newlines()
+	{
+		int cached = newlines.load(memory_order_relaxed);
+		if (cached >= 0)
+			return cached;
+		int count = 0;
+		for (int i = 0; i < size; i++)
+			if (data[i] == '\n')
+				count++;
+		newlines.store(count, memory_order_relaxed);
+		return count;
+	}
+
+	unsigned long long Hash()
+	{
+		unsigned long long cached = contentHash.load(memory_order_relaxed);
+		if (cached != 0)
+			return cached;
+		unsigned long long hash = 0;
+		for (int i = 0; i < size; i++)
+			hash = hash * HASH_BASE + data[i];
+		contentHash.store(hash, memory_order_relaxed);
+		return hash;
+	}
+
+	/// <summary>Returns the mutable byte store; only write to it while the leaf is being filled.</summary>
+	unsigned char* WritableData()
+	{
+		return (unsigned char*)data;
+	}
+
+	int Length() {
+		return size;
+	}
+
+	virtual Node* SubNode(int start, int end);
+
+	wchar_t GetCharAt(int index)
+	{
+		return (wchar_t)data[index];
+	}
+
+	/// <summary>Returns the contiguous byte span backing this leaf.</summary>
+	const unsigned char* Data()
+	{
+		return data;
+	}
+
+	void CopyTo (int sourceIndex, wchar_t* destination, int destinationIndex, int count) {
+		// Widening load; the compiler vectorizes this into zero-extends.
+		const unsigned char* src = data + sourceIndex;
+		wchar_t* ptr = destination + destinationIndex;
+		for (int i = 0; i < count; i++)
+			ptr[i] = (wchar_t)src[i];
+	}
+
+	~ByteLeafNode()
+	{
+		if (size > BLOCK_SIZE)
+			delete [] data;
+	}
+};
+
+inline Pool ByteLeafNode::pool (sizeof(ByteLeafNode) + BLOCK_SIZE);
+
+/// <summary>Byte leaf for texts of at most SMALL_LEAF_SIZE characters; see SmallWideLeafNode.</summary>
+class SmallByteLeafNode : public ByteLeafNode
+{
+public:
+	/// <summary>Holds the pool all small byte leaves live in.</summary>
+	static Pool pool;
+
+	static void* operator new(size_t)
+	{
+		return pool.Allocate();
+	}
+
+	static void operator delete(void* block)
+	{
+		pool.Free(block);
+	}
+
+	SmallByteLeafNode(int size) : ByteLeafNode(size)
+	{
+	}
+};
+
+inline Pool SmallByteLeafNode::pool (sizeof(SmallByteLeafNode) + SMALL_LEAF_SIZE);
+
+/// <summary>
+/// Refcounted handle to a memory-mapped file region. Every leaf built over
+/// the mapping retains it, so the pages stay mapped for as long as any part
+/// of the tree (or a slice of it) is alive, and are unmapped with the last
+/// reference.
+/// </summary>
+class FileMapping
+{
+private:
+	atomic<int> refs;
+	const unsigned char* data;
+	size_t size;
+
+public:
+	FileMapping(const unsigned char* data, size_t size)
+	{
+		this->refs = 1;
+		this->data = data;
+		this->size = size;
+	}
+
+	~FileMapping()
+	{
+		munmap((void*)data, size);
+	}
+
+	void Retain()
+	{
+		refs.fetch_add(1, memory_order_relaxed);
+	}
+
+	void Release()
+	{
+		if (refs.fetch_sub(1, memory_order_acq_rel) == 1)
+			delete this;
+	}
+
+	const unsigned char* Data()
+	{
+		return data;
+	}
+};
+
+/// <summary>
+/// Leaf viewing a range of a memory-mapped file directly. Loading a file
+/// costs tree metadata only; the file's pages fault in lazily when CopyTo
+/// or GetCharAt first touches them. The bytes are read as Latin-1, exactly
+/// like ByteLeafNode storage.
+/// </summary>
+class MappedLeafNode : public Node
+{
+private:
+	FileMapping* mapping;
+	const unsigned char* data;
+	int size;
+	// Cached newline count, -1 until first asked for; see WideLeafNode.
+	atomic<int> newlines;
+	// Cached content hash, 0 until first asked for; see WideLeafNode.
+	atomic<unsigned long long> contentHash;
+
+public:
+	/// <summary>Holds the pool all mapped leaf nodes live in.</summary>
+	static Pool pool;
+
+	static void* operator new(size_t)
+	{
+		return pool.Allocate();
+	}
+
+	static void operator delete(void* block)
+	{
+		pool.Free(block);
+	}
+
+	MappedLeafNode(FileMapping* mapping, int offset, int size) : Node(MAPPED_LEAF_NODE)
+	{
+		mapping->Retain();
+		this->mapping = mapping;
+		this->data = mapping->Data() + offset;
+		this->size = size;
+		this->newlines = -1;
+		this->contentHash = 0;
+	}
+
+	~MappedLeafNode()
+	{
+		mapping->Release();
+	}
+
+	int Newlines()
+	{
+		int cached = newlines.load(memory_order_relaxed);
+		if (cached >= 0)
+			return cached;
+		int count = 0;
+		for (int i = 0; i < size; i++)
+			if (data[i] == '\n')
+				count++;
+		newlines.store(count, memory_order_relaxed);
+		return count;
+	}
+
+	unsigned long long Hash()
+	{
+		unsigned long long cached = contentHash.load(memory_order_relaxed);
+		if (cached != 0)
+			return cached;
+		unsigned long long hash = 0;
+		for (int i = 0; i < size; i++)
+			hash = hash * HASH_BASE + data[i];
+		contentHash.store(hash, memory_order_relaxed);
+		return hash;
+	}
+
+	int Length() {
+		return size;
+	}
+
+	virtual Node* SubNode(int start, int end)  {
+		if (start == 0 && end == size) {
+			Retain();
+			return this;
+		}
+		// Sub-ranges stay views of the same mapping; nothing is copied.
+		return new MappedLeafNode(mapping, (int)(data - mapping->Data()) + start, end - start);
+	}
+
+	wchar_t GetCharAt(int index)
+	{
+		return (wchar_t)data[index];
+	}
+
+	/// <summary>Returns the contiguous byte span this leaf views.</summary>
+	const unsigned char* Data()
+	{
+		return data;
+	}
+
+	void CopyTo (int sourceIndex, wchar_t* destination, int destinationIndex, int count) {
+		// Widening load; the compiler vectorizes this into zero-extends.
+		const unsigned char* src = data + sourceIndex;
+		wchar_t* ptr = destination + destinationIndex;
+		for (int i = 0; i < count; i++)
+			ptr[i] = (wchar_t)src[i];
+	}
+};
+
+inline Pool MappedLeafNode::pool (sizeof(MappedLeafNode));
+
+/// <summary>
+/// Zero-copy view of a range of a leaf (wide or byte). Slicing produces
+/// these instead of copying characters, so GetText/SubText is pure pointer
+/// work; the copy is deferred until a later ConcatNodes merge materializes
+/// the range through CopyTo. The slice retains its base leaf, keeping the
+/// underlying store alive as long as any view of it exists.
+/// </summary>
+class SliceNode : public Node
+{
+private:
+	Node* base;
+	int offset;
+	int size;
+	// Cached newline count, -1 until first asked for; see WideLeafNode.
+	atomic<int> newlines;
+	// Cached content hash, 0 until first asked for; see WideLeafNode.
+	atomic<unsigned long long> contentHash;
+
+public:
+	/// <summary>Holds the pool all slice nodes live in.</summary>
+	static Pool pool;
+
+	static void* operator new(size_t)
+	{
+		return pool.Allocate();
+	}
+
+	static void operator delete(void* block)
+	{
+		pool.Free(block);
+	}
+
+	SliceNode(Node* base, int offset, int size) : Node(SLICE_NODE)
+	{
+		base->Retain();
+		this->base = base;
+		this->offset = offset;
+		this->size = size;
+		this->newlines = -1;
+		this->contentHash = 0;
+	}
+
+	int Newlines();
+	unsigned long long Hash();
+
+	~SliceNode()
+	{
+		base->Release();
+	}
+
+	/// <summary>Returns the leaf this slice views.</summary>
+	Node* Base()
+	{
+		return base;
+	}
+
+	/// <summary>Returns the slice's start offset inside its base leaf.</summary>
+	int Offset()
+	{
+		return offset;
+	}
+
+	int Length() {
+		return size;
+	}
+
+	virtual Node* SubNode(int start, int end)  {
+		if (start == 0 && end == size) {
+			Retain();
+			return this;
+		}
+		// Slices of slices reference the base leaf directly so view chains stay flat.
+		return new SliceNode(base, offset + start, end - start);
+	}
+
+	wchar_t GetCharAt(int index)
+	{
+		return base->GetCharAt(offset + index);
+	}
+
+	void CopyTo (int sourceIndex, wchar_t* destination, int destinationIndex, int count) {
+		base->CopyTo(offset + sourceIndex, destination, destinationIndex, count);
+	}
+};
+
+inline Pool SliceNode::pool (sizeof(SliceNode));
+
+Node* WideLeafNode::SubNode(int start, int end)
+{
+	if (start == 0 && end == Length()) {
+		Retain();
+		return this;
+	}
+	return new SliceNode(this, start, end - start);
+}
+
+Node* ByteLeafNode::SubNode(int start, int end)
+{
+	if (start == 0 && end == Length()) {
+		Retain();
+		return this;
+	}
+	return new SliceNode(this, start, end - start);
+}
+
+/// <summary>Raw storage span behind a leaf or slice node; exactly one of wide/bytes is set.</summary>
+struct LeafSpan
+{
+	const wchar_t* wide;
+	const unsigned char* bytes;
+	int length;
+};
+
+/// <summary>Resolves a leaf or slice node to the storage span it covers.</summary>
+inline LeafSpan SpanOf(Node* node)
+{
+	LeafSpan span;
+	span.wide = 0;
+	span.bytes = 0;
+	span.length = node->Length();
+	int offset = 0;
+	if (node->Kind() == SLICE_NODE) {
+		SliceNode* slice = (SliceNode*)node;
+		offset = slice->Offset();
+		node = slice->Base();
+	}
+	if (node->Kind() == BYTE_LEAF_NODE)
+		span.bytes = ((ByteLeafNode*)node)->Data() + offset;
+	else if (node->Kind() == MAPPED_LEAF_NODE)
+		span.bytes = ((MappedLeafNode*)node)->Data() + offset;
+	else
+		span.wide = ((WideLeafNode*)node)->Data() + offset;
+	return span;
+}
+
+/// <summary>Reads one character out of a resolved span, widening byte storage.</summary>
+inline wchar_t SpanCharAt(const LeafSpan& span, int index)
+{
+	return span.wide != 0 ? span.wide[index] : (wchar_t)span.bytes[index];
+}
+
+inline int SliceNode::Newlines()
+{
+	int cached = newlines.load(memory_order_relaxed);
+	if (cached >= 0)
+		return cached;
+	LeafSpan span = SpanOf(this);
+	int count = 0;
+	for (int i = 0; i < span.length; i++) {
+		wchar_t c = span.wide != 0 ? span.wide[i] : (wchar_t)span.bytes[i];
+		if (c == L'\n')
+			count++;
+	}
+	newlines.store(count, memory_order_relaxed);
+	return count;
+}
+
+inline unsigned long long SliceNode::Hash()
+{
+	unsigned long long cached = contentHash.load(memory_order_relaxed);
+	if (cached != 0)
+		return cached;
+	LeafSpan span = SpanOf(this);
+	unsigned long long hash = 0;
+	for (int i = 0; i < span.length; i++)
+		hash = hash * HASH_BASE + (span.wide != 0 ? span.wide[i] : span.bytes[i]);
+	contentHash.store(hash, memory_order_relaxed);
+	return hash;
+}
+
+/// <summary>Tells whether a leaf or slice node is backed by Latin-1 byte storage.</summary>
+inline bool IsLatin1(Node* node)
+{
+	if (node->Kind() == SLICE_NODE)
+		node = ((SliceNode*)node)->Base();
+	return node->Kind() == BYTE_LEAF_NODE || node->Kind() == MAPPED_LEAF_NODE;
+}
+
+/// <summary>
+/// Builds the densest leaf that can hold the given characters: a Latin-1
+/// byte leaf when every character fits in one byte, a wide leaf otherwise.
+/// </summary>
+inline Node* LeafOf(const wchar_t* chars, int length)
+{
+	bool latin1 = true;
+	for (int i = 0; i < length; i++) {
+		if (chars[i] > 0xFF) {
+			latin1 = false;
+			break;
+		}
+	}
+	if (!latin1) {
+		WideLeafNode* leaf = length <= SMALL_LEAF_SIZE ? new SmallWideLeafNode(length) : new WideLeafNode(length);
+		memcpy(leaf->WritableData(), chars, length * sizeof(wchar_t));
+		return leaf;
+	}
+	ByteLeafNode* leaf = length <= SMALL_LEAF_SIZE ? new SmallByteLeafNode(length) : new ByteLeafNode(length);
+	for (int i = 0; i < length; i++)
+		leaf->WritableData()[i] = (unsigned char)chars[i];
+	return leaf;
+}
+
+inline Node* NodeOf (Node* node, int offset, int length);
+inline Node* ConcatNodes (Node* node1, Node* node2);
+
+class CompositeNode : public Node
+{
+public:
+	int count;
+	Node* head;
+	Node* tail;
+	// Longest composite chain below this node, maintained at construction;
+	// the skew detector compares it against BalancedDepthBound.
+	int depth;
+
+private:
+	// Summed lazily from the children (-1 until first asked for), so that
+	// building a tree over a memory-mapped file does not fault in every
+	// page just to count newlines.
+	atomic<int> newlines;
+	// Cached content hash, 0 until first asked for; combined from the
+	// children's hashes, so an edited tree rehashes only its spine.
+	atomic<unsigned long long> contentHash;
+
+public:
+
+	/// <summary>Holds the pool all composite nodes live in.</summary>
+	static Pool pool;
+
+	static void* operator new(size_t)
+	{
+		return pool.Allocate();
+	}
+
+	static void operator delete(void* block)
+	{
+		pool.Free(block);
+	}
+
+	CompositeNode(int count, Node* head, Node* tail) : Node(COMPOSITE_NODE)
+	{
+		this->count = count;
+		this->head = head;
+		this->tail = tail;
+		this->depth = 1 + (DepthOf(head) > DepthOf(tail) ? DepthOf(head) : DepthOf(tail));
+		this->newlines = -1;
+		this->contentHash = 0;
+	}
+
+	/// <summary>Returns the composite depth of a node; leaves and slices count 0.</summary>
+	static int DepthOf(Node* node)
+	{
+		return node->IsComposite() ? ((CompositeNode*)node)->depth : 0;
+	}
+
+	int Newlines()
+	{
+		int cached = newlines.load(memory_order_relaxed);
+		if (cached >= 0)
+			return cached;
+		int count = head->Newlines() + tail->Newlines();
+		newlines.store(count, memory_order_relaxed);
+		return count;
+	}
+
+	unsigned long long Hash()
+	{
+		unsigned long long cached = contentHash.load(memory_order_relaxed);
+		if (cached != 0)
+			return cached;
+		unsigned long long hash = HashShift(head->Hash(), tail->Length()) + tail->Hash();
+		contentHash.store(hash, memory_order_relaxed);
+		return hash;
+	}
+
+	int Length() {
+		return count;
+	}
+
+	virtual Node* SubNode(int start, int end)  {
+		int cesure = head->Length();
+		if (end <= cesure) {
+			return head->SubNode(start, end);
+		}
+
+		if (start >= cesure) {
+		 return tail->SubNode(start - cesure, end - cesure);
+	 }
+
+		if (start == 0 && end == count) {
+			Retain();
+			return this;
+		}
+		// Overlaps head and tail.
+		Node* headPart = head->SubNode(start, cesure);
+		Node* tailPart = tail->SubNode(0, end - cesure);
+		Node* result = ConcatNodes(headPart, tailPart);
+		headPart->Release();
+		tailPart->Release();
+		return result;
+	}
+
+	wchar_t GetCharAt(int index)
+	{
+		int headLength = head->Length();
+		if (index < headLength) {
+			return head->GetCharAt(index);
+		}
+		return tail->GetCharAt(index - headLength);
+	}
+
+	void CopyTo (int sourceIndex, wchar_t* destination, int destinationIndex, int count) {
+		int cesure = head->Length();
+		if (sourceIndex + count <= cesure) {
+			head->CopyTo(sourceIndex, destination, destinationIndex, count);
+			return;
+		}
+		if (sourceIndex >= cesure) {
+			tail->CopyTo(sourceIndex - cesure, destination, destinationIndex, count);
+			return;
+		}
+		// Overlaps head and tail.
+		int headChunkSize = cesure - sourceIndex;
+		head->CopyTo(sourceIndex, destination, destinationIndex, headChunkSize);
+		tail->CopyTo(0, destination, destinationIndex + headChunkSize, count - headChunkSize);
+	}
+
+	~CompositeNode()
+	{
+		head->Release();
+		tail->Release();
+	}
+
+	CompositeNode* RotateRight()
+	{
+		if (!head->IsComposite()) {
+			Retain();
+			return this;
+		}
+		CompositeNode* P = (CompositeNode*)head;
+		Node* A = P->head;
+	 	Node* B = P->tail;
+	 	Node* C = this->tail;
+		A->Retain();
+		B->Retain();
+		C->Retain();
+		int tailLength = B->Length() + C->Length();
+		return new CompositeNode(A->Length() + tailLength, A, new CompositeNode(tailLength, B, C ));
+	}
+
+	CompositeNode* RotateLeft()
+	{
+	 // See: http://en.wikipedia.org/wiki/Tree_rotation
+	 if (!tail->IsComposite()) {
+		 Retain();
+		 return this;
+	 }
+
+		 CompositeNode* Q = (CompositeNode*)tail;
+	 Node* B = Q->head;
+	 Node* C = Q->tail;
+	 Node* A = this->head;
+	 A->Retain();
+	 B->Retain();
+	 C->Retain();
+	 int headLength = A->Length() + B->Length();
+	 return new CompositeNode (headLength +  C->Length(), new CompositeNode (headLength, A, B), C);
+	}
+};
+
+inline Pool CompositeNode::pool (sizeof(CompositeNode));
+
+inline Node* ConcatNodes (Node* node1, Node* node2)
+{
+ // Arguments are borrowed; the returned node carries one fresh reference.
+ // All Text instances are maintained balanced:
+ //   (head < tail * 2) & (tail < head * 2)
+ TEXT_STATS_COUNT(concatCalls);
+ int length = node1->Length() + node2->Length();
+ if (length <= BLOCK_SIZE) { // Merges to primitive.
+	 TEXT_STATS_COUNT(leafMerges);
+	 if (IsLatin1(node1) && IsLatin1(node2)) {
+		 // Both sides are byte-backed, so the merge stays in one byte per character.
+		 ByteLeafNode* merged = length <= SMALL_LEAF_SIZE ? new SmallByteLeafNode(length) : new ByteLeafNode(length);
+		 memcpy(merged->WritableData(), SpanOf(node1).bytes, node1->Length());
+		 memcpy(merged->WritableData() + node1->Length(), SpanOf(node2).bytes, node2->Length());
+		 return merged;
+	 }
+	 WideLeafNode* merged = length <= SMALL_LEAF_SIZE ? new SmallWideLeafNode(length) : new WideLeafNode(length);
+	 node1->CopyTo (0, merged->WritableData(), 0, node1->Length());
+	 node2->CopyTo (0, merged->WritableData(), node1->Length(), node2->Length());
+	 return merged;
+ }
+ // Returns a composite.
+ Node* head = node1;
+ Node* tail = node2;
+ if (tail->IsComposite() && (head->Length() << 1) < tail->Length()) {
+	 // head too small, returns (head + tail/2) + (tail/2)
+	 CompositeNode* compositeTail = (CompositeNode*)tail;
+	 compositeTail->Retain ();
+	 if (compositeTail->head->Length() > compositeTail->tail->Length()) {
+		 // Rotates to concatenate with smaller part.
+		 CompositeNode* rotated = compositeTail->RotateRight ();
+		 compositeTail->Release ();
+		 compositeTail = rotated;
+	 }
+	 head = ConcatNodes (head, compositeTail->head);
+	 tail = compositeTail->tail;
+	 tail->Retain ();
+	 compositeTail->Release ();
+ } else {
+	 head->Retain ();
+	 tail->Retain ();
+	 if (head->IsComposite()) {
+		 CompositeNode* compositeHead = (CompositeNode*)head;
+		 if ((tail->Length() << 1) < head->Length()) {
+			 // tail too small, returns (head/2) + (head/2 concat tail)
+			 if (compositeHead->tail->Length() > compositeHead->head->Length()) {
+				 // Rotates to concatenate with smaller part.
+				 compositeHead = compositeHead->RotateLeft ();
+			 } else {
+				 compositeHead->Retain ();
+			 }
+			 Node* newTail = ConcatNodes (compositeHead->tail, tail);
+			 tail->Release ();
+			 tail = newTail;
+			 head->Release ();
+			 head = compositeHead->head;
+			 head->Retain ();
+			 compositeHead->Release ();
+		 }
+	 }
+ }
+ return new CompositeNode (head->Length() + tail->Length(), head, tail);
+}
+
+/// <summary>
+/// Returns the depth above which a tree of the given length counts as
+/// skewed. A tree satisfying the weight invariant at every composite is at
+/// most ~1.71 log2(length) levels deep; allowing two levels per doubling
+/// of the length means only genuinely degenerate shapes trip the bound.
+/// </summary>
+inline int BalancedDepthBound(int length)
+{
+	int bound = 2;
+	while (length > BLOCK_SIZE) {
+		length >>= 1;
+		bound += 2;
+	}
+	return bound;
+}
+
+/// <summary>
+/// Restores balance in a tree whose depth exceeds its bound, using the
+/// rotation primitives instead of a full NodeOf rebuild. The heavy side of
+/// each skewed composite is rotated up (pre-rotated first so its smaller
+/// half is what moves, as in ConcatNodes) until the weight invariant holds
+/// there, then the children are repaired recursively. Subtrees already
+/// within their own bound are kept as-is, so repair cost is proportional
+/// to the skewed part, and everything the old tree shares with snapshots
+/// stays untouched. The argument is borrowed; the returned node carries
+/// one fresh reference.
+/// </summary>
+inline Node* RebalanceNode(Node* node)
+{
+	if (!node->IsComposite() || CompositeNode::DepthOf(node) <= BalancedDepthBound(node->Length())) {
+		node->Retain();
+		return node;
+	}
+	CompositeNode* composite = (CompositeNode*)node;
+	composite->Retain();
+	for (;;) {
+		Node* head = composite->head;
+		Node* tail = composite->tail;
+		if (tail->IsComposite() && (head->Length() << 1) <= tail->Length()) {
+			CompositeNode* compositeTail = (CompositeNode*)tail;
+			if (compositeTail->head->Length() > compositeTail->tail->Length() && compositeTail->head->IsComposite()) {
+				CompositeNode* rotatedTail = compositeTail->RotateRight();
+				head->Retain();
+				CompositeNode* next = new CompositeNode(composite->count, head, rotatedTail);
+				composite->Release();
+				composite = next;
+			}
+			CompositeNode* rotated = composite->RotateLeft();
+			composite->Release();
+			composite = rotated;
+			continue;
+		}
+		if (head->IsComposite() && (tail->Length() << 1) <= head->Length()) {
+			CompositeNode* compositeHead = (CompositeNode*)head;
+			if (compositeHead->tail->Length() > compositeHead->head->Length() && compositeHead->tail->IsComposite()) {
+				CompositeNode* rotatedHead = compositeHead->RotateLeft();
+				tail->Retain();
+				CompositeNode* next = new CompositeNode(composite->count, rotatedHead, tail);
+				composite->Release();
+				composite = next;
+			}
+			CompositeNode* rotated = composite->RotateRight();
+			composite->Release();
+			composite = rotated;
+			continue;
+		}
+		break;
+	}
+	Node* head = RebalanceNode(composite->head);
+	Node* tail = RebalanceNode(composite->tail);
+	if (head == composite->head && tail == composite->tail) {
+		head->Release();
+		tail->Release();
+		return composite;
+	}
+	Node* result = new CompositeNode(head->Length() + tail->Length(), head, tail);
+	composite->Release();
+	return result;
+}
+
+inline Node* NodeOf (Node* node, int offset, int length)
+{
+ TEXT_STATS_COUNT(nodeOfCalls);
+ if (length <= BLOCK_SIZE) {
+	 return node->SubNode (offset, offset + length);
+ }
+ // Splits on a block boundary.
+ int half = ((length + BLOCK_SIZE) >> 1) & BLOCK_MASK;
+ Node* head = NodeOf (node, offset, half);
+ Node* tail = NodeOf (node, offset + half, length - half);
+ return new CompositeNode (head->Length() + tail->Length(), head, tail);
+}
+
+/// <summary>
+/// Parallel NodeOf: fans the two independent recursive halves out across
+/// threads while the range is large and workers remain, then joins into the
+/// same balanced CompositeNode shape the sequential build produces. Safe
+/// because construction only reads the source tree; pools and refcounts are
+/// already thread-safe for snapshot readers.
+/// </summary>
+inline Node* ParallelNodeOf (Node* node, int offset, int length, int workers)
+{
+ if (length < PARALLEL_CHUNK_CUTOFF || workers <= 1) {
+	 return NodeOf (node, offset, length);
+ }
+ int half = ((length + BLOCK_SIZE) >> 1) & BLOCK_MASK;
+ Node* head = 0;
+ thread helper([&]() { head = ParallelNodeOf (node, offset, half, workers >> 1); });
+ Node* tail = ParallelNodeOf (node, offset + half, length - half, workers - (workers >> 1));
+ helper.join ();
+ return new CompositeNode (head->Length() + tail->Length(), head, tail);
+}
+
+inline Node* ParallelNodeOf (Node* node, int offset, int length)
+{
+ return ParallelNodeOf (node, offset, length, (int)thread::hardware_concurrency());
+}
+
+/// <summary>
+/// Runs a reduction kernel over every leaf of a subtree and sums the
+/// partial results. Byte and mapped storage is widened through a stack
+/// buffer so the kernel always sees contiguous wchar_t spans, like
+/// ForEachChunk. Serial building block of ParallelReduceNode.
+/// </summary>
+template <typename Kernel>
+long long ReduceNode(Node* node, Kernel& kernel)
+{
+	if (node->IsComposite()) {
+		CompositeNode* composite = (CompositeNode*)node;
+		return ReduceNode(composite->head, kernel) + ReduceNode(composite->tail, kernel);
+	}
+	LeafSpan span = SpanOf(node);
+	if (span.wide != 0)
+		return kernel(span.wide, span.length);
+	wchar_t widened[BLOCK_SIZE];
+	long long total = 0;
+	for (int done = 0; done < span.length; ) {
+		int count = span.length - done < BLOCK_SIZE ? span.length - done : BLOCK_SIZE;
+		node->CopyTo(done, widened, 0, count);
+		total += kernel((const wchar_t*)widened, count);
+		done += count;
+	}
+	return total;
+}
+
+/// <summary>
+/// Parallel ReduceNode: the two-child structure splits the work for free,
+/// so large halves fan out across threads exactly like ParallelNodeOf.
+/// The kernel runs concurrently and must be pure.
+/// </summary>
+template <typename Kernel>
+long long ParallelReduceNode(Node* node, Kernel& kernel, int workers)
+{
+	if (node->Length() < PARALLEL_CHUNK_CUTOFF || workers <= 1 || !node->IsComposite())
+		return ReduceNode(node, kernel);
+	CompositeNode* composite = (CompositeNode*)node;
+	long long headTotal = 0;
+	thread helper([&]() { headTotal = ParallelReduceNode(composite->head, kernel, workers >> 1); });
+	long long tailTotal = ParallelReduceNode(composite->tail, kernel, workers - (workers >> 1));
+	helper.join();
+	return headTotal + tailTotal;
+}
+
+/// <summary>
+/// Rebuilds a subtree with every character mapped through the kernel.
+/// Lengths are unchanged, so the new tree keeps the old one's exact shape
+/// and balance; each leaf is re-packed through LeafOf, so a transform that
+/// stays in Latin-1 stays byte-backed. Returns one fresh reference.
+/// </summary>
+template <typename Kernel>
+Node* TransformNode(Node* node, Kernel& kernel)
+{
+	if (node->IsComposite()) {
+		CompositeNode* composite = (CompositeNode*)node;
+		Node* head = TransformNode(composite->head, kernel);
+		Node* tail = TransformNode(composite->tail, kernel);
+		return new CompositeNode(composite->count, head, tail);
+	}
+	LeafSpan span = SpanOf(node);
+	wchar_t buffer[BLOCK_SIZE];
+	// Oversized leaves only exist in flat unchunked texts.
+	wchar_t* mapped = span.length <= BLOCK_SIZE ? buffer : new wchar_t[span.length];
+	for (int i = 0; i < span.length; i++)
+		mapped[i] = kernel(SpanCharAt(span, i));
+	Node* leaf = LeafOf(mapped, span.length);
+	if (mapped != buffer)
+		delete [] mapped;
+	return leaf;
+}
+
+/// <summary>Parallel TransformNode, fanned out like ParallelNodeOf; the kernel must be pure.</summary>
+template <typename Kernel>
+Node* ParallelTransformNode(Node* node, Kernel& kernel, int workers)
+{
+	if (node->Length() < PARALLEL_CHUNK_CUTOFF || workers <= 1 || !node->IsComposite())
+		return TransformNode(node, kernel);
+	CompositeNode* composite = (CompositeNode*)node;
+	Node* head = 0;
+	thread helper([&]() { head = ParallelTransformNode(composite->head, kernel, workers >> 1); });
+	Node* tail = ParallelTransformNode(composite->tail, kernel, workers - (workers >> 1));
+	helper.join();
+	return new CompositeNode(composite->count, head, tail);
+}
+
+/// <summary>Builds the balanced chunked tree of mapped leaves over a range of a file mapping.</summary>
+inline Node* MappedNodeOf (FileMapping* mapping, int offset, int length)
+{
+ if (length <= BLOCK_SIZE) {
+	 return new MappedLeafNode (mapping, offset, length);
+ }
+ // Splits on a block boundary.
+ int half = ((length + BLOCK_SIZE) >> 1) & BLOCK_MASK;
+ Node* head = MappedNodeOf (mapping, offset, half);
+ Node* tail = MappedNodeOf (mapping, offset + half, length - half);
+ return new CompositeNode (head->Length() + tail->Length(), head, tail);
+}
+
+struct InnerLeaf
+{
+	Node* leafNode;
+	int offset;
+};
+
+/// <summary>
+/// One edit in a batch: removes removeCount characters at offset, then
+/// inserts text at the same place. Offsets refer to the original text.
+/// </summary>
+struct TextEdit
+{
+	int offset;
+	int removeCount;
+	wstring text;
+};
+
+/// <summary>
+/// The changed region between two snapshots: the old text's characters
+/// [start, start + removedLength) were replaced by the new text's
+/// [start, start + insertedLength). Disjoint edits between the snapshots
+/// coalesce into the single spanning region.
+/// </summary>
+struct TextChange
+{
+	int start;
+	int removedLength;
+	int insertedLength;
+};
+
+/// <summary>
+/// A cheap value type: one owned root handle plus the tail block. Copies
+/// share the tree by reference (a retain and two words), moves steal it,
+/// and the editing methods return new values, so an edit chain allocates
+/// no wrapper objects at all. The underlying nodes keep their atomic
+/// refcounts, which is what lets copies travel across threads.
+/// </summary>
+class ImmutableText
+{
+	// The serializer walks the tree from the root; see TextWriter.
+	friend class TextWriter;
+
+private:
+	// Owned root; 0 only in moved-from instances.
+	Node* root;
+
+	// Uncommitted tail block: up to BLOCK_SIZE appended characters that
+	// have not been concatenated into the tree yet. Absorbing consecutive
+	// end-of-text inserts here makes log-style append amortized O(1)
+	// instead of one ConcatNodes rebalance per character.
+	wchar_t* pending;
+	int pendingLength;
+
+	// Last-leaf locality cache: consecutive GetCharAt/FindLeaf calls land in
+	// the same 64-char block, so the last descent result is served on a
+	// bounds check instead of a root descent. The stamp is a seqlock keeping
+	// the (leaf, offset) pair consistent for concurrent snapshot readers;
+	// updates are best effort and skipped under contention. The cache only
+	// ever points into the current root tree, which outlives it.
+	atomic<unsigned> leafCacheStamp;
+	atomic<Node*> leafCacheNode;
+	atomic<int> leafCacheOffset;
+
+	/// <summary>Serves a FindLeaf request from the locality cache; returns false on a miss.</summary>
+	bool LookupLeafCache(int index, InnerLeaf& result)
+	{
+		unsigned stamp = leafCacheStamp.load(memory_order_acquire);
+		if ((stamp & 1) != 0)
+			return false;
+		Node* leaf = leafCacheNode.load(memory_order_acquire);
+		int offset = leafCacheOffset.load(memory_order_acquire);
+		if (leafCacheStamp.load(memory_order_acquire) != stamp)
+			return false;
+		if (leaf == 0 || index < offset || index >= offset + leaf->Length())
+			return false;
+		result.leafNode = leaf;
+		result.offset = offset;
+		return true;
+	}
+
+	/// <summary>Verifies a candidate match, reading inside the span and through GetCharAt past its end.</summary>
+	bool MatchesAt(int candidate, LeafSpan span, int spanStart, const wstring& needle)
+	{
+		int needleLength = (int)needle.length();
+		int inSpan = span.length - (candidate - spanStart);
+		if (inSpan > needleLength)
+			inSpan = needleLength;
+		for (int i = 0; i < inSpan; i++) {
+			int index = candidate - spanStart + i;
+			wchar_t character = span.wide != 0 ? span.wide[index] : (wchar_t)span.bytes[index];
+			if (character != needle[i])
+				return false;
+		}
+		// The straddling tail goes through GetCharAt; the locality cache makes
+		// the adjacent-leaf lookups cheap, and straddles are rare anyway.
+		for (int i = inSpan; i < needleLength; i++)
+			if (GetCharAt(candidate + i) != needle[i])
+				return false;
+		return true;
+	}
+
+	/// <summary>Collects the chain of subtrees starting exactly at pos, largest first.</summary>
+	static void ChainAt(Node* root, int pos, vector<Node*>& chain)
+	{
+		Node* node = root;
+		int start = 0;
+		while (1) {
+			if (start == pos)
+				chain.push_back(node);
+			if (!node->IsComposite())
+				return;
+			CompositeNode* composite = (CompositeNode*)node;
+			if (pos < start + composite->head->Length()) {
+				node = composite->head;
+			} else {
+				start += composite->head->Length();
+				node = composite->tail;
+			}
+		}
+	}
+
+	/// <summary>Collects the chain of subtrees ending exactly at pos, largest first.</summary>
+	static void ChainEndingAt(Node* root, int rootLength, int pos, vector<Node*>& chain)
+	{
+		Node* node = root;
+		int end = rootLength;
+		while (1) {
+			if (end == pos)
+				chain.push_back(node);
+			if (!node->IsComposite())
+				return;
+			CompositeNode* composite = (CompositeNode*)node;
+			int cesure = end - composite->tail->Length();
+			if (pos > cesure) {
+				node = composite->tail;
+			} else {
+				end = cesure;
+				node = composite->head;
+			}
+		}
+	}
+
+	/// <summary>Returns the largest subtree both chains share by pointer, or 0.</summary>
+	static Node* SharedNode(const vector<Node*>& chainA, const vector<Node*>& chainB)
+	{
+		for (size_t i = 0; i < chainA.size(); i++)
+			for (size_t j = 0; j < chainB.size(); j++)
+				if (chainA[i] == chainB[j])
+					return chainA[i];
+		return 0;
+	}
+
+	/// <summary>Publishes the last resolved leaf to the locality cache.</summary>
+	void StoreLeafCache(Node* leaf, int offset)
+	{
+		unsigned stamp = leafCacheStamp.load(memory_order_relaxed);
+		if ((stamp & 1) != 0)
+			return;
+		if (!leafCacheStamp.compare_exchange_strong(stamp, stamp + 1, memory_order_acquire))
+			return;
+		leafCacheNode.store(leaf, memory_order_relaxed);
+		leafCacheOffset.store(offset, memory_order_relaxed);
+		leafCacheStamp.store(stamp + 2, memory_order_release);
+	}
+
+	/// <summary>Lazily allocates the uncommitted tail block.</summary>
+	void EnsurePending()
+	{
+		if (pending == 0)
+			pending = new wchar_t[BLOCK_SIZE];
+	}
+
+	/// <summary>Copies the whole logical content (tree plus tail block) into the destination.</summary>
+	void CopyContent(wchar_t* destination)
+	{
+		root->CopyTo(0, destination, 0, root->Length());
+		if (pendingLength > 0)
+			memcpy(destination + root->Length(), pending, pendingLength * sizeof(wchar_t));
+	}
+
+public:
+	/// <summary>Wraps an already-owned node; the text takes over its reference.</summary>
+	ImmutableText(Node* root)
+	{
+		this->root = root;
+		this->pending = 0;
+		this->pendingLength = 0;
+		this->leafCacheStamp = 0;
+		this->leafCacheNode = 0;
+		this->leafCacheOffset = 0;
+	}
+
+	/// <summary>Creates the empty text.</summary>
+	ImmutableText() : ImmutableText((Node*)new WideLeafNode(0))
+	{
+	}
+
+	ImmutableText(wstring str) : ImmutableText(LeafOf(str.c_str(), str.length()))
+	{
+	}
+
+	ImmutableText(const ImmutableText& that)
+	{
+		that.root->Retain();
+		this->root = that.root;
+		this->pending = 0;
+		this->pendingLength = that.pendingLength;
+		this->leafCacheStamp = 0;
+		this->leafCacheNode = 0;
+		this->leafCacheOffset = 0;
+		if (that.pendingLength > 0) {
+			EnsurePending();
+			memcpy(pending, that.pending, that.pendingLength * sizeof(wchar_t));
+		}
+	}
+
+	ImmutableText(ImmutableText&& that)
+	{
+		this->root = that.root;
+		this->pending = that.pending;
+		this->pendingLength = that.pendingLength;
+		this->leafCacheStamp = 0;
+		this->leafCacheNode = 0;
+		this->leafCacheOffset = 0;
+		that.root = 0;
+		that.pending = 0;
+		that.pendingLength = 0;
+	}
+
+	ImmutableText& operator=(const ImmutableText& that)
+	{
+		if (this == &that)
+			return *this;
+		that.root->Retain();
+		if (root != 0)
+			root->Release();
+		root = that.root;
+		pendingLength = that.pendingLength;
+		if (pendingLength > 0) {
+			EnsurePending();
+			memcpy(pending, that.pending, pendingLength * sizeof(wchar_t));
+		}
+		leafCacheNode.store(0, memory_order_relaxed);
+		return *this;
+	}
+
+	ImmutableText& operator=(ImmutableText&& that)
+	{
+		if (this == &that)
+			return *this;
+		if (root != 0)
+			root->Release();
+		delete [] pending;
+		root = that.root;
+		pending = that.pending;
+		pendingLength = that.pendingLength;
+		that.root = 0;
+		that.pending = 0;
+		that.pendingLength = 0;
+		leafCacheNode.store(0, memory_order_relaxed);
+		return *this;
+	}
+
+	/// <summary>
+	/// Opens a file as an immutable text whose leaves reference a shared
+	/// memory mapping of it. Only the tree metadata is built up front, so
+	/// opening is O(length / BLOCK_SIZE) regardless of how much of the file
+	/// is ever read; pages fault in lazily on first access. The file bytes
+	/// are interpreted as Latin-1. Returns false when the file cannot be
+	/// opened or mapped, leaving the given text untouched.
+	/// </summary>
+	static bool FromFile(const char* path, ImmutableText& text)
+	{
+		int descriptor = open(path, O_RDONLY);
+		if (descriptor < 0)
+			return false;
+		struct stat info;
+		if (fstat(descriptor, &info) != 0 || info.st_size > 0x7fffffff) {
+			close(descriptor);
+			return false;
+		}
+		if (info.st_size == 0) {
+			close(descriptor);
+			text = ImmutableText();
+			return true;
+		}
+		void* region = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+		close(descriptor);
+		if (region == MAP_FAILED)
+			return false;
+		FileMapping* mapping = new FileMapping((const unsigned char*)region, info.st_size);
+		text = ImmutableText(MappedNodeOf(mapping, 0, (int)info.st_size));
+		mapping->Release();
+		return true;
+	}
+
+	/// <summary>Writes this text to the stream in the TextWriter format.</summary>
+	bool Serialize(FILE* stream);
+
+	/// <summary>Reads one text written by Serialize; false on a short or corrupt stream.</summary>
+	static bool Deserialize(FILE* stream, ImmutableText& text);
+
+	~ImmutableText()
+	{
+		if (root != 0)
+			root->Release();
+		delete [] pending;
+	}
+
+	/// <summary>
+	/// Commits the uncommitted tail block into the tree. The logical content
+	/// is unchanged, so sealing is safe at any time; it happens automatically
+	/// before any structural operation or snapshot hand-off.
+	/// </summary>
+	void Seal()
+	{
+		if (pendingLength == 0)
+			return;
+		Node* leaf = LeafOf(pending, pendingLength);
+		Node* sealedRoot = ConcatNodes(root, leaf);
+		leaf->Release();
+		// The locality cache points into the old tree; drop it with the root.
+		leafCacheNode.store(0, memory_order_relaxed);
+		root->Release();
+		root = sealedRoot;
+		pendingLength = 0;
+	}
+
+	int Length()
+	{
+		return root->Length() + pendingLength;
+	}
+
+	wchar_t GetCharAt(int index)
+	{
+		if (index >= root->Length())
+			return pending[index - root->Length()];
+		InnerLeaf leaf = FindLeaf(index, 0);
+		return leaf.leafNode->GetCharAt(index - leaf.offset);
+	}
+
+	/// <summary>
+	/// Returns this text in chunked form: a tree whose leaves all hold at
+	/// most BLOCK_SIZE characters. Only a flat text longer than a block is
+	/// ever rebuilt, and only once; after that, edits keep trees chunked
+	/// incrementally by reusing the untouched siblings by reference, so the
+	/// common case returns this unchanged.
+	/// </summary>
+	ImmutableText EnsureChunked()
+	{
+		Seal();
+		int len = Length();
+		if (!root->IsComposite() && len > BLOCK_SIZE) {
+			TEXT_STATS_COUNT(fullRebuilds);
+			return ImmutableText(ParallelNodeOf (root, 0, len));
+		}
+		// Repeated one-sided edits can skew the tree between concat points;
+		// every edit passes through here, so the depth check keeps FindLeaf
+		// at its O(log n) promise no matter the edit pattern.
+		if (CompositeNode::DepthOf(root) > BalancedDepthBound(len)) {
+			TEXT_STATS_COUNT(rebalances);
+			return ImmutableText(RebalanceNode(root));
+		}
+		return *this;
+	}
+
+	/// <summary>Returns the composite depth of the tree, a balance diagnostic.</summary>
+	int Depth()
+	{
+		Seal();
+		return CompositeNode::DepthOf(root);
+	}
+
+#ifdef IMMUTABLE_TEXT_STATS
+	/// <summary>Adds this text's shape metrics to a stats snapshot; see TextStats.</summary>
+	void CollectStats(struct TextStats& stats);
+#endif
+
+	InnerLeaf FindLeaf(int index, int offset)
+	{
+		Seal();
+		InnerLeaf result;
+		result.leafNode = 0;
+		result.offset = -1;
+		if (offset == 0 && LookupLeafCache(index, result)) {
+			TEXT_STATS_COUNT(leafCacheHits);
+			return result;
+		}
+		TEXT_STATS_COUNT(findLeafDescents);
+		Node* node = this->root;
+		while (1) {
+			if (index >= node->Length()) {
+				return result;
+			}
+			if (node->IsComposite()) {
+				TEXT_STATS_COUNT(findLeafSteps);
+				CompositeNode* composite = (CompositeNode*)node;
+				if (index < composite->head->Length()) {
+					node = composite->head;
+				} else {
+					offset += composite->head->Length();
+					index -= composite->head->Length();
+					node = composite->tail;
+				}
+				continue;
+			}
+			result.leafNode = node;
+			result.offset = offset;
+			StoreLeafCache(node, offset);
+			return result;
+		}
+	}
+
+	/// <summary>Returns the number of lines in this text (newline count + 1).</summary>
+	int LineCount()
+	{
+		Seal();
+		return root->Newlines() + 1;
+	}
+
+	/// <summary>
+	/// Returns a 64-bit hash of the characters, independent of tree shape.
+	/// Every node caches its value, so a repeat call is O(1) and hashing
+	/// after an edit is O(log n): only the rebuilt spine computes, the
+	/// shared subtrees answer from their caches.
+	/// </summary>
+	unsigned long long ContentHash()
+	{
+		Seal();
+		return root->Hash();
+	}
+
+	/// <summary>
+	/// Returns the offset of the first character of the given 0-based line,
+	/// descending the tree via the cached per-node newline counts in O(log n).
+	/// Lines past the last one map to the text length.
+	/// </summary>
+	int LineToOffset(int line)
+	{
+		Seal();
+		if (line <= 0)
+			return 0;
+		Node* node = root;
+		int offset = 0;
+		while (node->IsComposite()) {
+			CompositeNode* composite = (CompositeNode*)node;
+			if (line <= composite->head->Newlines()) {
+				node = composite->head;
+			} else {
+				line -= composite->head->Newlines();
+				offset += composite->head->Length();
+				node = composite->tail;
+			}
+		}
+		LeafSpan span = SpanOf(node);
+		for (int i = 0; i < span.length; i++) {
+			wchar_t character = span.wide != 0 ? span.wide[i] : (wchar_t)span.bytes[i];
+			if (character == L'\n' && --line == 0)
+				return offset + i + 1;
+		}
+		return offset + span.length;
+	}
+
+	/// <summary>
+	/// Returns the 0-based line containing the given offset, descending the
+	/// tree via the cached per-node newline counts in O(log n).
+	/// </summary>
+	int OffsetToLine(int offset)
+	{
+		Seal();
+		Node* node = root;
+		int line = 0;
+		while (node->IsComposite()) {
+			CompositeNode* composite = (CompositeNode*)node;
+			if (offset < composite->head->Length()) {
+				node = composite->head;
+			} else {
+				line += composite->head->Newlines();
+				offset -= composite->head->Length();
+				node = composite->tail;
+			}
+		}
+		LeafSpan span = SpanOf(node);
+		if (offset > span.length)
+			offset = span.length;
+		for (int i = 0; i < offset; i++) {
+			wchar_t character = span.wide != 0 ? span.wide[i] : (wchar_t)span.bytes[i];
+			if (character == L'\n')
+				line++;
+		}
+		return line;
+	}
+
+	/// <summary>
+	/// Returns the offset of the first occurrence of needle at or after
+	/// start, or -1 when there is none. Walks the leaves in order and scans
+	/// each contiguous span with the vectorized memchr/wmemchr kernels, so
+	/// the search makes no intermediate copy of the document; matches that
+	/// straddle a block boundary are verified across leaves.
+	/// </summary>
+	int IndexOf(const wstring& needle, int start = 0)
+	{
+		Seal();
+		int needleLength = (int)needle.length();
+		int length = Length();
+		if (start < 0)
+			start = 0;
+		if (needleLength == 0)
+			return start <= length ? start : -1;
+		wchar_t first = needle[0];
+		int position = start;
+		while (position + needleLength <= length) {
+			InnerLeaf leaf = FindLeaf(position, 0);
+			LeafSpan span = SpanOf(leaf.leafNode);
+			int spanIndex = position - leaf.offset;
+			while (spanIndex < span.length) {
+				int found = -1;
+				if (span.wide != 0) {
+					const wchar_t* hit = wmemchr(span.wide + spanIndex, first, span.length - spanIndex);
+					if (hit != 0)
+						found = (int)(hit - span.wide);
+				} else if (first <= 0xFF) {
+					const void* hit = memchr(span.bytes + spanIndex, (unsigned char)first, span.length - spanIndex);
+					if (hit != 0)
+						found = (int)((const unsigned char*)hit - span.bytes);
+				}
+				if (found < 0)
+					break;
+				int candidate = leaf.offset + found;
+				if (candidate + needleLength > length)
+					return -1;
+				if (MatchesAt(candidate, span, leaf.offset, needle))
+					return candidate;
+				spanIndex = found + 1;
+			}
+			position = leaf.offset + span.length;
+		}
+		return -1;
+	}
+
+	/// <summary>
+	/// Computes the changed region between two snapshots. Edits built through
+	/// ConcatNodes reuse untouched subtrees by pointer, so the descent prunes
+	/// identical-pointer subtrees in O(1) from both ends and only compares
+	/// characters around the edit itself: O(log n + changed) for snapshots
+	/// that share structure. Unrelated texts degrade to a plain compare.
+	/// </summary>
+	static TextChange Diff(ImmutableText& oldText, ImmutableText& newText)
+	{
+		oldText.Seal();
+		newText.Seal();
+		int oldLength = oldText.Length();
+		int newLength = newText.Length();
+		int limit = oldLength < newLength ? oldLength : newLength;
+		vector<Node*> chainA;
+		vector<Node*> chainB;
+		int prefix = 0;
+		while (prefix < limit) {
+			chainA.clear();
+			chainB.clear();
+			ChainAt(oldText.root, prefix, chainA);
+			ChainAt(newText.root, prefix, chainB);
+			Node* shared = SharedNode(chainA, chainB);
+			if (shared != 0 && shared->Length() > 0) {
+				prefix += shared->Length();
+				continue;
+			}
+			InnerLeaf leafA = oldText.FindLeaf(prefix, 0);
+			InnerLeaf leafB = newText.FindLeaf(prefix, 0);
+			LeafSpan spanA = SpanOf(leafA.leafNode);
+			LeafSpan spanB = SpanOf(leafB.leafNode);
+			int indexA = prefix - leafA.offset;
+			int indexB = prefix - leafB.offset;
+			int run = spanA.length - indexA < spanB.length - indexB ? spanA.length - indexA : spanB.length - indexB;
+			if (run > limit - prefix)
+				run = limit - prefix;
+			int matched = 0;
+			while (matched < run && SpanCharAt(spanA, indexA + matched) == SpanCharAt(spanB, indexB + matched))
+				matched++;
+			prefix += matched;
+			if (matched < run)
+				break;
+		}
+		int suffix = 0;
+		while (suffix < limit - prefix) {
+			int endA = oldLength - suffix;
+			int endB = newLength - suffix;
+			chainA.clear();
+			chainB.clear();
+			ChainEndingAt(oldText.root, oldLength, endA, chainA);
+			ChainEndingAt(newText.root, newLength, endB, chainB);
+			Node* shared = SharedNode(chainA, chainB);
+			if (shared != 0 && shared->Length() > 0 && shared->Length() <= limit - prefix - suffix) {
+				suffix += shared->Length();
+				continue;
+			}
+			InnerLeaf leafA = oldText.FindLeaf(endA - 1, 0);
+			InnerLeaf leafB = newText.FindLeaf(endB - 1, 0);
+			LeafSpan spanA = SpanOf(leafA.leafNode);
+			LeafSpan spanB = SpanOf(leafB.leafNode);
+			int indexA = endA - 1 - leafA.offset;
+			int indexB = endB - 1 - leafB.offset;
+			int run = indexA < indexB ? indexA + 1 : indexB + 1;
+			if (run > limit - prefix - suffix)
+				run = limit - prefix - suffix;
+			int matched = 0;
+			while (matched < run && SpanCharAt(spanA, indexA - matched) == SpanCharAt(spanB, indexB - matched))
+				matched++;
+			suffix += matched;
+			if (matched < run)
+				break;
+		}
+		TextChange change;
+		change.start = prefix;
+		change.removedLength = oldLength - prefix - suffix;
+		change.insertedLength = newLength - prefix - suffix;
+		return change;
+	}
+
+	/// <summary>
+	/// Concatenates the specified text to the end of this text.
+	/// This method is very fast (faster even than
+	/// <code>StringBuffer.append(String)</code>) and still returns
+	/// a text instance with an internal binary tree of minimal depth!
+	/// </summary>
+	/// <param name="that">that the text that is concatenated.</param>
+	/// <returns><code>this + that</code></returns>
+	ImmutableText Concat(ImmutableText& that)
+	{
+		if (that.Length() == 0)
+			return *this;
+		if (this->Length() == 0)
+			return that;
+		ImmutableText head = this->EnsureChunked ();
+		ImmutableText tail = that.EnsureChunked ();
+		return ImmutableText (ConcatNodes (head.root, tail.root));
+	}
+
+	/// <summary>
+	/// Returns a portion of this text.
+	// </summary>
+	/// <returns>the sub-text starting at the specified start position and ending just before the specified end position.</returns>
+	ImmutableText GetText(int start, int count)
+	{
+		int end = start + count;
+		if (start == 0 && end == Length())
+			return *this;
+		if (start == end)
+			return ImmutableText ();
+		Seal();
+		return ImmutableText (this->root->SubNode (start, end));
+	}
+
+	ImmutableText InsertText(int index, ImmutableText& text)
+	 {
+		int textLength = text.Length();
+		if (index == Length() && textLength <= BLOCK_SIZE) {
+			// Append fast path: absorb the insert into the uncommitted tail
+			// block and only touch the tree once the block runs full.
+			if (pendingLength + textLength <= BLOCK_SIZE) {
+				root->Retain();
+				ImmutableText result(root);
+				result.EnsurePending();
+				if (pendingLength > 0)
+					memcpy(result.pending, pending, pendingLength * sizeof(wchar_t));
+				text.CopyContent(result.pending + pendingLength);
+				result.pendingLength = pendingLength + textLength;
+				return result;
+			}
+			Seal();
+			root->Retain();
+			ImmutableText result(root);
+			result.EnsurePending();
+			text.CopyContent(result.pending);
+			result.pendingLength = textLength;
+			return result;
+		}
+		// Slicing the chunked tree shares every untouched subtree by
+		// reference, so the edit only touches the O(log n) nodes on its path.
+		ImmutableText chunked = this->EnsureChunked ();
+		ImmutableText head = chunked.GetText (0, index);
+		ImmutableText tail = chunked.SubText (index);
+		ImmutableText merged = head.Concat (text);
+		return merged.Concat (tail);
+	}
+	/*
+	func (this ImmutableText) InsertString(index int, text string) ImmutableText {
+		return this.InsertText (index, CreateImmutableText (text))
+	}
+
+	func CreateImmutableText (text string) ImmutableText {
+		return ImmutableText { WideLeafNode { []rune(text) } }
+	}
+
+	*/
+
+	/// <summary>
+	/// Returns the text without the characters between the specified indexes.
+	/// </summary>
+	/// <returns><code>subtext(0, start).concat(subtext(end))</code></returns>
+	ImmutableText RemoveText(int start, int count)
+	{
+		if (count == 0)
+			return *this;
+		int end = start + count;
+	//	if (end > Length)
+	//		throw new IndexOutOfRangeException ();
+		ImmutableText chunked = this->EnsureChunked ();
+		ImmutableText head = chunked.GetText (0, start);
+		ImmutableText tail = chunked.SubText (end);
+		return head.Concat (tail);
+	}
+
+	ImmutableText SubText(int start)
+	{
+		return this->GetText (start, this->Length() - start);
+	}
+
+	/// <summary>
+	/// Applies a batch of edits in one pass. The edits must be sorted by
+	/// offset and non-overlapping, with offsets referring to this text.
+	/// The untouched ranges between edits are reused by reference and the
+	/// pieces are combined pairwise bottom-up, so the whole batch pays for
+	/// one balanced rebuild instead of a slice+concat+rebalance per edit.
+	/// </summary>
+	ImmutableText ApplyEdits(const TextEdit* edits, int editCount)
+	{
+		if (editCount == 0)
+			return *this;
+		ImmutableText chunked = EnsureChunked();
+		Node* base = chunked.root;
+		vector<Node*> pieces;
+		int position = 0;
+		for (int i = 0; i < editCount; i++) {
+			if (edits[i].offset > position)
+				pieces.push_back(base->SubNode(position, edits[i].offset));
+			int textLength = edits[i].text.length();
+			if (textLength > 0) {
+				Node* leaf = LeafOf(edits[i].text.c_str(), textLength);
+				if (textLength > BLOCK_SIZE) {
+					Node* chunked = NodeOf(leaf, 0, textLength);
+					leaf->Release();
+					pieces.push_back(chunked);
+				} else {
+					pieces.push_back(leaf);
+				}
+			}
+			position = edits[i].offset + edits[i].removeCount;
+		}
+		if (position < base->Length())
+			pieces.push_back(base->SubNode(position, base->Length()));
+		if (pieces.empty())
+			return ImmutableText();
+		// Combines adjacent pieces in rounds; ConcatNodes keeps each merge balanced.
+		while (pieces.size() > 1) {
+			vector<Node*> merged;
+			for (size_t i = 0; i + 1 < pieces.size(); i += 2) {
+				merged.push_back(ConcatNodes(pieces[i], pieces[i + 1]));
+				pieces[i]->Release();
+				pieces[i + 1]->Release();
+			}
+			if (pieces.size() % 2 == 1)
+				merged.push_back(pieces[pieces.size() - 1]);
+			pieces = merged;
+		}
+		return ImmutableText(pieces[0]);
+	}
+	wstring ToString()
+	{
+		wchar_t* runes = new wchar_t[this->Length()];
+		this->CopyContent(runes);
+		wstring result (runes, this->Length());
+		delete [] runes;
+		return result;
+	}
+
+	/// <summary>
+	/// Streams the content as (pointer, length) spans in order without
+	/// materializing the document, so file save and IPC can gather straight
+	/// from leaf storage instead of peaking at 2x memory through ToString.
+	/// Wide leaves are handed out zero-copy; byte and mapped leaves are
+	/// widened through a stack block of at most BLOCK_SIZE characters per
+	/// call. The callback receives (const wchar_t*, int).
+	/// </summary>
+	template <typename Callback>
+	void ForEachChunk(Callback&& callback)
+	{
+		Seal();
+		int length = Length();
+		int offset = 0;
+		wchar_t widened[BLOCK_SIZE];
+		while (offset < length) {
+			InnerLeaf leaf = FindLeaf(offset, 0);
+			int intra = offset - leaf.offset;
+			LeafSpan span = SpanOf(leaf.leafNode);
+			int remaining = span.length - intra;
+			if (span.wide != 0) {
+				callback(span.wide + intra, remaining);
+			} else {
+				remaining = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
+				leaf.leafNode->CopyTo(intra, widened, 0, remaining);
+				callback((const wchar_t*)widened, remaining);
+			}
+			offset += remaining;
+		}
+	}
+
+	/// <summary>
+	/// Full-document reduction (count, checksum, validation) on all cores:
+	/// partitions the tree at the PARALLEL_CHUNK_CUTOFF grain, runs
+	/// kernel(const wchar_t* chars, int length) -> long long over
+	/// contiguous widened spans on worker threads, and sums the partial
+	/// results. The kernel is called concurrently and must be pure.
+	/// </summary>
+	template <typename Kernel>
+	long long ParallelReduce(Kernel&& kernel)
+	{
+		Seal();
+		return ParallelReduceNode(root, kernel, (int)thread::hardware_concurrency());
+	}
+
+	/// <summary>
+	/// Full-document transformation (normalization, case mapping) on all
+	/// cores: rebuilds the tree with every character mapped through
+	/// kernel(wchar_t) -> wchar_t, preserving the tree's exact shape so no
+	/// rebalancing follows. The kernel is called concurrently and must be
+	/// pure.
+	/// </summary>
+	template <typename Kernel>
+	ImmutableText ParallelTransform(Kernel&& kernel)
+	{
+		Seal();
+		return ImmutableText(ParallelTransformNode(root, kernel, (int)thread::hardware_concurrency()));
+	}
+};
+
+/// <summary>
+/// Sequential character reader over a text. Keeps the leaf the current
+/// position falls into and serves reads straight from its character store,
+/// only re-descending the tree at block boundaries. A full scan is thereby
+/// amortized O(1) per character instead of one root descent each.
+/// </summary>
+class CharCursor
+{
+private:
+	// Own handle; keeps the tree alive however far the source moves on.
+	ImmutableText text;
+	LeafSpan span;
+	int leafOffset;
+	int position;
+
+	void Descend()
+	{
+		InnerLeaf leaf = text.FindLeaf(position, 0);
+		span = SpanOf(leaf.leafNode);
+		leafOffset = leaf.offset;
+	}
+
+public:
+	CharCursor(const ImmutableText& text, int position = 0) : text(text)
+	{
+		this->span.wide = 0;
+		this->span.bytes = 0;
+		this->span.length = 0;
+		this->leafOffset = 0;
+		this->position = position;
+	}
+
+	int Position()
+	{
+		return position;
+	}
+
+	/// <summary>Repositions the cursor; the cached leaf is kept when the new position still falls into it.</summary>
+	void MoveTo(int position)
+	{
+		this->position = position;
+	}
+
+	bool HasNext()
+	{
+		return position < text.Length();
+	}
+
+	/// <summary>Returns the character at the current position and advances by one.</summary>
+	wchar_t Next()
+	{
+		if (position < leafOffset || position >= leafOffset + span.length)
+			Descend();
+		int index = position++ - leafOffset;
+		return span.wide != 0 ? span.wide[index] : (wchar_t)span.bytes[index];
+	}
+};
+
+/// <summary>
+/// Iterates the leaves of a text in order, exposing each one's contiguous
+/// character span, so whole-buffer passes can run over raw arrays instead
+/// of per-character tree walks.
+/// </summary>
+class LeafCursor
+{
+private:
+	// Own handle; keeps the tree alive however far the source moves on.
+	ImmutableText text;
+	int offset;
+	// Widening buffer for byte-backed leaves; wide leaves are handed out zero-copy.
+	wchar_t buffer[BLOCK_SIZE];
+
+public:
+	LeafCursor(const ImmutableText& text) : text(text)
+	{
+		this->offset = 0;
+	}
+
+	/// <summary>Fetches the next leaf span; returns false once the text is exhausted.</summary>
+	bool Next(const wchar_t*& data, int& length)
+	{
+		if (offset >= text.Length())
+			return false;
+		InnerLeaf leaf = text.FindLeaf(offset, 0);
+		int intra = offset - leaf.offset;
+		LeafSpan span = SpanOf(leaf.leafNode);
+		int remaining = span.length - intra;
+		if (span.wide != 0) {
+			data = span.wide + intra;
+			length = remaining;
+		} else {
+			// Byte leaves are widened through the cursor's buffer, at most
+			// BLOCK_SIZE characters per call.
+			length = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
+			leaf.leafNode->CopyTo(intra, buffer, 0, length);
+			data = buffer;
+		}
+		offset += length;
+		return true;
+	}
+};
+
+/// <summary>
+/// Writes texts to a stream in a binary form that preserves the tree: leaves
+/// carry their characters, slices and composites carry child record ids, and
+/// a subtree reachable from several texts (snapshots, undo entries) is
+/// written once and referenced by id afterwards, so a whole history costs
+/// O(unique data). Write every text of a session through the same writer to
+/// keep that sharing. The format uses host byte order and wchar_t width; it
+/// is a session-restore cache, not an interchange format.
+/// </summary>
+class TextWriter
+{
+private:
+	FILE* stream;
+	// Record id per node already written; the keys are retained so an
+	// address cannot be recycled and aliased while the writer is alive.
+	unordered_map<Node*, int> ids;
+	bool ok;
+
+	void Put(const void* data, size_t size)
+	{
+		if (ok && fwrite(data, size, 1, stream) != 1)
+			ok = false;
+	}
+
+	void PutTag(char tag)
+	{
+		Put(&tag, 1);
+	}
+
+	void PutInt(int value)
+	{
+		Put(&value, sizeof(int));
+	}
+
+	/// <summary>Writes the subtree once, children first, and returns its record id.</summary>
+	int WriteNode(Node* node)
+	{
+		unordered_map<Node*, int>::iterator found = ids.find(node);
+		if (found != ids.end())
+			return found->second;
+		if (node->IsComposite()) {
+			CompositeNode* composite = (CompositeNode*)node;
+			int headId = WriteNode(composite->head);
+			int tailId = WriteNode(composite->tail);
+			PutTag('C');
+			PutInt(headId);
+			PutInt(tailId);
+		} else if (node->Kind() == SLICE_NODE) {
+			SliceNode* slice = (SliceNode*)node;
+			int baseId = WriteNode(slice->Base());
+			PutTag('S');
+			PutInt(baseId);
+			PutInt(slice->Offset());
+			PutInt(slice->Length());
+		} else {
+			// Mapped leaves are written out as byte leaves; the mapping is
+			// a load-time optimization, not part of the logical tree.
+			LeafSpan span = SpanOf(node);
+			if (span.bytes != 0) {
+				PutTag('B');
+				PutInt(span.length);
+				Put(span.bytes, span.length);
+			} else {
+				PutTag('W');
+				PutInt(span.length);
+				Put(span.wide, span.length * sizeof(wchar_t));
+			}
+		}
+		int id = (int)ids.size();
+		node->Retain();
+		ids[node] = id;
+		return id;
+	}
+
+public:
+	TextWriter(FILE* stream)
+	{
+		this->stream = stream;
+		this->ok = true;
+	}
+
+	~TextWriter()
+	{
+		for (unordered_map<Node*, int>::iterator it = ids.begin(); it != ids.end(); ++it)
+			it->first->Release();
+	}
+
+	/// <summary>Writes one text; subtrees already on the stream are referenced, not repeated.</summary>
+	bool Write(ImmutableText text)
+	{
+		text.Seal();
+		int rootId = WriteNode(text.root);
+		PutTag('T');
+		PutInt(rootId);
+		return ok;
+	}
+};
+
+/// <summary>
+/// Reads texts written by a TextWriter, rebuilding the exact tree — no
+/// chunking, rebalancing, or newline counting happens on load. Shared
+/// subtrees come back shared: a referenced record id resolves to the node
+/// already built for it. Call Read once per text written.
+/// </summary>
+class TextReader
+{
+private:
+	FILE* stream;
+	// One retained node per record, indexed by record id.
+	vector<Node*> nodes;
+
+	bool Get(void* data, size_t size)
+	{
+		return fread(data, size, 1, stream) == 1;
+	}
+
+	bool GetInt(int& value)
+	{
+		return Get(&value, sizeof(int));
+	}
+
+	/// <summary>Resolves a child record id, rejecting forward or out-of-range references.</summary>
+	bool Lookup(int id, Node*& node)
+	{
+		if (id < 0 || id >= (int)nodes.size())
+			return false;
+		node = nodes[id];
+		return true;
+	}
+
+public:
+	TextReader(FILE* stream)
+	{
+		this->stream = stream;
+	}
+
+	~TextReader()
+	{
+		for (size_t i = 0; i < nodes.size(); i++)
+			nodes[i]->Release();
+	}
+
+	/// <summary>Reads records up to the next complete text; false at end of stream or on corruption.</summary>
+	bool Read(ImmutableText& text)
+	{
+		for (;;) {
+			char tag;
+			if (!Get(&tag, 1))
+				return false;
+			if (tag == 'W') {
+				int length;
+				if (!GetInt(length) || length < 0)
+					return false;
+				WideLeafNode* leaf = length <= SMALL_LEAF_SIZE ? new SmallWideLeafNode(length) : new WideLeafNode(length);
+				if (length > 0 && !Get(leaf->WritableData(), length * sizeof(wchar_t))) {
+					leaf->Release();
+					return false;
+				}
+				nodes.push_back(leaf);
+			} else if (tag == 'B') {
+				int length;
+				if (!GetInt(length) || length < 0)
+					return false;
+				ByteLeafNode* leaf = length <= SMALL_LEAF_SIZE ? new SmallByteLeafNode(length) : new ByteLeafNode(length);
+				if (length > 0 && !Get(leaf->WritableData(), length)) {
+					leaf->Release();
+					return false;
+				}
+				nodes.push_back(leaf);
+			} else if (tag == 'S') {
+				int baseId, offset, size;
+				Node* base;
+				if (!GetInt(baseId) || !GetInt(offset) || !GetInt(size) || !Lookup(baseId, base))
+					return false;
+				if (offset < 0 || size < 0 || offset + size > base->Length())
+					return false;
+				nodes.push_back(new SliceNode(base, offset, size));
+			} else if (tag == 'C') {
+				int headId, tailId;
+				Node* head;
+				Node* tail;
+				if (!GetInt(headId) || !GetInt(tailId) || !Lookup(headId, head) || !Lookup(tailId, tail))
+					return false;
+				head->Retain();
+				tail->Retain();
+				nodes.push_back(new CompositeNode(head->Length() + tail->Length(), head, tail));
+			} else if (tag == 'T') {
+				int rootId;
+				Node* root;
+				if (!GetInt(rootId) || !Lookup(rootId, root))
+					return false;
+				root->Retain();
+				text = ImmutableText(root);
+				return true;
+			} else {
+				return false;
+			}
+		}
+	}
+};
+
+inline bool ImmutableText::Serialize(FILE* stream)
+{
+	TextWriter writer(stream);
+	return writer.Write(*this);
+}
+
+inline bool ImmutableText::Deserialize(FILE* stream, ImmutableText& text)
+{
+	TextReader reader(stream);
+	return reader.Read(text);
+}
+
+/// <summary>
+/// Mutable front-end holding the current text by value. The owning thread
+/// edits through Insert/Remove/Apply/Replace while background threads take
+/// snapshot copies under a brief lock; a snapshot shares the tree by
+/// reference and stays alive until it goes out of scope, no matter how far
+/// the buffer has moved on. Texts are sealed before publication, so a
+/// published text's root never changes and a snapshot copy is two words
+/// plus a retain.
+/// </summary>
+class TextBuffer
+{
+private:
+	ImmutableText current;
+	// Guards the publish/copy pair only; reading a snapshot never locks.
+	mutex swapLock;
+
+	/// <summary>Publishes a new text and retires the previous one.</summary>
+	void Publish(ImmutableText text)
+	{
+		text.Seal();
+		lock_guard<mutex> guard(swapLock);
+		current = move(text);
+	}
+
+public:
+	TextBuffer(wstring str) : current(str)
+	{
+		current.Seal();
+	}
+
+	TextBuffer(const ImmutableText& text) : current(text)
+	{
+		current.Seal();
+	}
+
+	int Length()
+	{
+		lock_guard<mutex> guard(swapLock);
+		return current.Length();
+	}
+
+	/// <summary>Returns a snapshot sharing the current tree by reference.</summary>
+	ImmutableText Snapshot()
+	{
+		lock_guard<mutex> guard(swapLock);
+		return current;
+	}
+
+	/// <summary>Replaces the whole content with the given text.</summary>
+	void Replace(const ImmutableText& text)
+	{
+		Publish(text);
+	}
+
+	void Insert(int index, ImmutableText& text)
+	{
+		Publish(current.InsertText(index, text));
+	}
+
+	void Remove(int start, int count)
+	{
+		Publish(current.RemoveText(start, count));
+	}
+
+	void Apply(const TextEdit* edits, int editCount)
+	{
+		Publish(current.ApplyEdits(edits, editCount));
+	}
+};
+
+/// <summary>
+/// Builds a text from a stream of character chunks without buffering the
+/// whole input first. Arriving characters are packed into BLOCK_SIZE
+/// leaves; completed leaves feed a binary-counter stack of balanced
+/// subtrees (one per power-of-two block count), so construction is O(n)
+/// with O(log n) working state and never rebalances after the fact.
+/// Snapshot() assembles the subtrees into a readable text at any point -
+/// the first screenful can render while the rest still streams in.
+/// Not thread safe; publish snapshots through a TextBuffer if readers
+/// live on other threads.
+/// </summary>
+class TextBuilder
+{
+private:
+	// levels[i] holds a balanced subtree of exactly 2^i full blocks, or 0;
+	// finished blocks carry through it like a binary counter.
+	vector<Node*> levels;
+	wchar_t block[BLOCK_SIZE];
+	int blockLength;
+	int length;
+
+	/// <summary>Carries a finished block-multiple subtree into the counter; consumes the reference.</summary>
+	void PushSubtree(Node* node)
+	{
+		for (size_t i = 0; ; i++) {
+			if (i == levels.size()) {
+				levels.push_back(node);
+				return;
+			}
+			if (levels[i] == 0) {
+				levels[i] = node;
+				return;
+			}
+			Node* merged = ConcatNodes(levels[i], node);
+			levels[i]->Release();
+			node->Release();
+			levels[i] = 0;
+			node = merged;
+		}
+	}
+
+public:
+	TextBuilder()
+	{
+		blockLength = 0;
+		length = 0;
+	}
+
+	~TextBuilder()
+	{
+		for (size_t i = 0; i < levels.size(); i++)
+			if (levels[i] != 0)
+				levels[i]->Release();
+	}
+
+	/// <summary>Appends a chunk of any size, packing it into block-aligned leaves.</summary>
+	void Append(const wchar_t* chars, int count)
+	{
+		length += count;
+		while (count > 0) {
+			int room = BLOCK_SIZE - blockLength;
+			int take = count < room ? count : room;
+			memcpy(block + blockLength, chars, take * sizeof(wchar_t));
+			blockLength += take;
+			chars += take;
+			count -= take;
+			if (blockLength == BLOCK_SIZE) {
+				PushSubtree(LeafOf(block, BLOCK_SIZE));
+				blockLength = 0;
+			}
+		}
+	}
+
+	void Append(const wstring& str)
+	{
+		Append(str.data(), (int)str.length());
+	}
+
+	/// <summary>Returns how many characters have been appended so far.</summary>
+	int Length()
+	{
+		return length;
+	}
+
+	/// <summary>
+	/// Assembles everything appended so far into a text, sharing the
+	/// already-built subtrees; the builder keeps streaming afterwards.
+	/// O(log n) concats per call.
+	/// </summary>
+	ImmutableText Snapshot()
+	{
+		Node* result = 0;
+		for (size_t i = 0; i < levels.size(); i++) {
+			if (levels[i] == 0)
+				continue;
+			if (result == 0) {
+				result = levels[i];
+				result->Retain();
+				continue;
+			}
+			Node* combined = ConcatNodes(levels[i], result);
+			result->Release();
+			result = combined;
+		}
+		if (blockLength > 0) {
+			Node* tail = LeafOf(block, blockLength);
+			if (result == 0) {
+				result = tail;
+			} else {
+				Node* combined = ConcatNodes(result, tail);
+				result->Release();
+				tail->Release();
+				result = combined;
+			}
+		}
+		if (result == 0)
+			return ImmutableText();
+		return ImmutableText(result);
+	}
+};
+
+/// <summary>One history entry: the text after an edit and the edit itself.</summary>
+struct UndoEntry
+{
+	ImmutableText text;
+	TextChange change;
+};
+
+/// <summary>
+/// Undo/redo history built on shared snapshots. Each entry retains the text
+/// after one edit; because consecutive snapshots share all untouched subtrees,
+/// an entry costs O(log n) nodes, not a document copy. Undo and redo just move
+/// the cursor along the chain and hand back the retained snapshot, so both are
+/// O(1). Consecutive single-character typing (and backspacing) coalesces into
+/// one entry, closed by Break() or by any edit elsewhere in the document.
+/// Not thread safe; drive it from the same thread that edits the buffer.
+/// </summary>
+class UndoStack
+{
+private:
+	vector<UndoEntry> entries;
+	// Index of the current text; entries[0] is the initial state.
+	size_t position;
+	// Whether the top entry is an open typing burst that may still grow.
+	bool coalescing;
+	int coalesceLimit;
+
+	/// <summary>True if the change extends the open burst: an insert right after
+	/// the previous one, or a backspace right before it.</summary>
+	bool Coalesces(const TextChange& change)
+	{
+		if (!coalescing || position != entries.size() - 1)
+			return false;
+		TextChange& last = entries[position].change;
+		if (last.insertedLength + last.removedLength + change.insertedLength + change.removedLength > coalesceLimit)
+			return false;
+		if (change.removedLength == 0 && last.removedLength == 0)
+			return change.start == last.start + last.insertedLength;
+		if (change.insertedLength == 0 && last.insertedLength == 0)
+			return change.start + change.removedLength == last.start;
+		return false;
+	}
+
+public:
+	UndoStack(const ImmutableText& initial, int coalesceLimit = 128)
+		: position(0), coalescing(false), coalesceLimit(coalesceLimit)
+	{
+		UndoEntry first = { initial, { 0, 0, 0 } };
+		first.text.Seal();
+		entries.push_back(first);
+	}
+
+	/// <summary>Records the text after an edit, dropping any redo entries.
+	/// A typing burst folds into the previous entry instead of adding one.</summary>
+	void Push(ImmutableText text, const TextChange& change)
+	{
+		text.Seal();
+		entries.resize(position + 1);
+		if (Coalesces(change)) {
+			UndoEntry& top = entries[position];
+			top.text = move(text);
+			if (change.removedLength == 0) {
+				top.change.insertedLength += change.insertedLength;
+			} else {
+				top.change.start = change.start;
+				top.change.removedLength += change.removedLength;
+			}
+			return;
+		}
+		UndoEntry entry = { move(text), change };
+		entries.push_back(move(entry));
+		position++;
+		coalescing = change.insertedLength <= 1 && change.removedLength <= 1
+			&& change.insertedLength + change.removedLength == 1;
+	}
+
+	/// <summary>Records the text after an edit, diffing it against the current
+	/// entry to locate the change.</summary>
+	void Push(ImmutableText text)
+	{
+		TextChange change = ImmutableText::Diff(entries[position].text, text);
+		Push(move(text), change);
+	}
+
+	/// <summary>Closes the open typing burst, e.g. when the caret moves.</summary>
+	void Break()
+	{
+		coalescing = false;
+	}
+
+	bool CanUndo()
+	{
+		return position > 0;
+	}
+
+	bool CanRedo()
+	{
+		return position < entries.size() - 1;
+	}
+
+	/// <summary>Steps back one entry and returns that snapshot.</summary>
+	ImmutableText Undo()
+	{
+		coalescing = false;
+		if (position > 0)
+			position--;
+		return entries[position].text;
+	}
+
+	/// <summary>Steps forward one entry and returns that snapshot.</summary>
+	ImmutableText Redo()
+	{
+		coalescing = false;
+		if (position < entries.size() - 1)
+			position++;
+		return entries[position].text;
+	}
+
+	/// <summary>The snapshot the stack currently points at.</summary>
+	ImmutableText Current()
+	{
+		return entries[position].text;
+	}
+
+	/// <summary>Number of undoable entries below the current position.</summary>
+	int Depth()
+	{
+		return (int)position;
+	}
+};
+
+#ifdef IMMUTABLE_TEXT_STATS
+
+/// <summary>
+/// Snapshot of the telemetry layer: the global event counters captured at a
+/// point in time, plus shape metrics of whichever texts are measured into
+/// it. bytesLive is slot bytes currently handed out by the pools;
+/// bytesLogical is what the measured texts' characters would cost flat, so
+/// the two bracket the structural overhead. Only compiled with
+/// IMMUTABLE_TEXT_STATS; the probes cost nothing without it.
+/// </summary>
+struct TextStats
+{
+	// Captured global counters.
+	long long concatCalls;
+	long long leafMerges;
+	long long nodeOfCalls;
+	long long fullRebuilds;
+	long long rebalances;
+	long long findLeafDescents;
+	long long findLeafSteps;
+	long long leafCacheHits;
+	long long poolAllocates;
+	long long poolFrees;
+	long long bytesLive;
+
+	// Accumulated by CollectStats over measured texts.
+	long long bytesLogical;
+	long long leafCount;
+	long long leafChars;
+	// Leaves binned by the composite depth they sit under.
+	int depthHistogram[48];
+	// Leaves binned by fullness, 16ths of BLOCK_SIZE; oversized leaves land
+	// in the last bin.
+	int leafSizeHistogram[17];
+
+	/// <summary>Reads the global counters into a fresh snapshot.</summary>
+	static TextStats Capture()
+	{
+		TextStats stats;
+		memset(&stats, 0, sizeof(stats));
+		stats.concatCalls = textStatsCounters.concatCalls.load(memory_order_relaxed);
+		stats.leafMerges = textStatsCounters.leafMerges.load(memory_order_relaxed);
+		stats.nodeOfCalls = textStatsCounters.nodeOfCalls.load(memory_order_relaxed);
+		stats.fullRebuilds = textStatsCounters.fullRebuilds.load(memory_order_relaxed);
+		stats.rebalances = textStatsCounters.rebalances.load(memory_order_relaxed);
+		stats.findLeafDescents = textStatsCounters.findLeafDescents.load(memory_order_relaxed);
+		stats.findLeafSteps = textStatsCounters.findLeafSteps.load(memory_order_relaxed);
+		stats.leafCacheHits = textStatsCounters.leafCacheHits.load(memory_order_relaxed);
+		stats.poolAllocates = textStatsCounters.poolAllocates.load(memory_order_relaxed);
+		stats.poolFrees = textStatsCounters.poolFrees.load(memory_order_relaxed);
+		stats.bytesLive = textStatsCounters.slotBytesAllocated.load(memory_order_relaxed)
+			- textStatsCounters.slotBytesFreed.load(memory_order_relaxed);
+		return stats;
+	}
+};
+
+/// <summary>Walks a subtree recording every leaf's size and depth into the snapshot.</summary>
+inline void MeasureNode(Node* node, int depth, TextStats& stats)
+{
+	if (node->IsComposite()) {
+		CompositeNode* composite = (CompositeNode*)node;
+		MeasureNode(composite->head, depth + 1, stats);
+		MeasureNode(composite->tail, depth + 1, stats);
+		return;
+	}
+	stats.leafCount++;
+	int length = node->Length();
+	stats.leafChars += length;
+	stats.depthHistogram[depth < 48 ? depth : 47]++;
+	int bin = length * 16 / BLOCK_SIZE;
+	stats.leafSizeHistogram[bin < 17 ? bin : 16]++;
+}
+
+inline void ImmutableText::CollectStats(TextStats& stats)
+{
+	Seal();
+	MeasureNode(root, 0, stats);
+	stats.bytesLogical += (long long)Length() * sizeof(wchar_t);
+}
+
+#endif // IMMUTABLE_TEXT_STATS
+
+
+#endif // IMMUTABLE_TEXT_H
@@ -0,0 +1,199 @@
+// Benchmark suite for the ImmutableText data structure.
+//
+// Covers the workloads an editor actually runs: random-position edits,
+// log-style append, sequential scans, full materialization, slicing, and
+// snapshot-under-edit, at several document sizes. Each run reports ops/sec,
+// how many pool slots were handed out, and the process peak RSS, so the
+// implementations (and the Java/C#/Go ports) can be compared honestly.
+//
+// Build:  g++ -std=c++17 -O2 -pthread -o immutable_text_bench immutable_text_bench.cc
+// Usage:  ./immutable_text_bench [--large]
+//         --large adds the 100MB document runs (needs ~1GB of RAM).
+//
+// To sweep leaf sizes, rebuild with -DIMMUTABLE_TEXT_BLOCK_SHIFT=<n> (default
+// 6, i.e. 64-char leaves) and compare runs; each report header names the
+// block size in effect. Rebuild with -DIMMUTABLE_TEXT_STATS to get the
+// telemetry counters dumped after the runs.
+
+#include "immutable_text.h"
+
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstdio>
+#include <sys/resource.h>
+
+static double Now()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static long long PoolAllocations()
+{
+	return WideLeafNode::pool.Allocations() + SmallWideLeafNode::pool.Allocations()
+		+ ByteLeafNode::pool.Allocations() + SmallByteLeafNode::pool.Allocations()
+		+ MappedLeafNode::pool.Allocations() + SliceNode::pool.Allocations()
+		+ CompositeNode::pool.Allocations();
+}
+
+static long PeakRssKb()
+{
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+static void Report(const char* name, int documentSize, long long ops, double elapsed, long long allocations)
+{
+	printf("%-22s %9d chars %12.0f ops/sec %10lld allocs %8ld MB peak\n",
+		name, documentSize, ops / elapsed, allocations, PeakRssKb() / 1024);
+}
+
+/// <summary>Builds a chunked document of the given size with line breaks every 60 characters.</summary>
+static ImmutableText MakeDocument(int size)
+{
+	wstring content(size, L'.');
+	for (int i = 0; i < size; i++)
+		content[i] = i % 60 == 59 ? L'\n' : L'a' + i % 26;
+	ImmutableText flat(content);
+	return flat.EnsureChunked();
+}
+
+static void RandomInsertRemove(int documentSize, long long ops)
+{
+	ImmutableText document = MakeDocument(documentSize);
+	ImmutableText insert(L"x");
+	long long allocationsBefore = PoolAllocations();
+	double start = Now();
+	for (long long i = 0; i < ops; i++) {
+		int position = rand() % (document.Length() + 1);
+		if (i % 2 == 0) {
+			document = document.InsertText(position, insert);
+		} else {
+			if (position == document.Length())
+				position--;
+			document = document.RemoveText(position, 1);
+		}
+	}
+	Report("random-insert-remove", documentSize, ops, Now() - start, PoolAllocations() - allocationsBefore);
+}
+
+static void AppendHeavy(int documentSize, long long ops)
+{
+	ImmutableText document = MakeDocument(documentSize);
+	ImmutableText line(L"log\n");
+	long long allocationsBefore = PoolAllocations();
+	double start = Now();
+	for (long long i = 0; i < ops; i++)
+		document = document.InsertText(document.Length(), line);
+	Report("append-heavy", documentSize, ops, Now() - start, PoolAllocations() - allocationsBefore);
+}
+
+static void SequentialScan(int documentSize)
+{
+	ImmutableText document = MakeDocument(documentSize);
+	long long allocationsBefore = PoolAllocations();
+	double start = Now();
+	long long checksum = 0;
+	CharCursor cursor(document);
+	while (cursor.HasNext())
+		checksum += cursor.Next();
+	double elapsed = Now() - start;
+	if (checksum == 42)
+		printf("?");
+	Report("sequential-scan", documentSize, document.Length(), elapsed, PoolAllocations() - allocationsBefore);
+}
+
+static void ToStringBench(int documentSize)
+{
+	ImmutableText document = MakeDocument(documentSize);
+	long long allocationsBefore = PoolAllocations();
+	const int rounds = 10;
+	double start = Now();
+	for (int i = 0; i < rounds; i++) {
+		wstring copy = document.ToString();
+		if (copy.length() != (size_t)documentSize)
+			abort();
+	}
+	Report("to-string", documentSize, (long long)rounds * documentSize, Now() - start, PoolAllocations() - allocationsBefore);
+}
+
+static void SliceBench(int documentSize, long long ops)
+{
+	ImmutableText document = MakeDocument(documentSize);
+	long long allocationsBefore = PoolAllocations();
+	double start = Now();
+	for (long long i = 0; i < ops; i++) {
+		int position = rand() % document.Length();
+		int count = rand() % (document.Length() - position) % 1000;
+		ImmutableText slice = document.GetText(position, count);
+	}
+	Report("get-text-slice", documentSize, ops, Now() - start, PoolAllocations() - allocationsBefore);
+}
+
+static void SnapshotUnderEdit(int documentSize, long long ops)
+{
+	TextBuffer buffer(MakeDocument(documentSize));
+	ImmutableText insert(L"y");
+	atomic<bool> done(false);
+	atomic<long long> reads(0);
+	thread reader([&]() {
+		while (!done.load()) {
+			ImmutableText snapshot = buffer.Snapshot();
+			CharCursor cursor(snapshot);
+			long long checksum = 0;
+			for (int i = 0; i < 1000 && cursor.HasNext(); i++)
+				checksum += cursor.Next();
+			reads.fetch_add(1);
+		}
+	});
+	long long allocationsBefore = PoolAllocations();
+	double start = Now();
+	for (long long i = 0; i < ops; i++)
+		buffer.Insert(rand() % (buffer.Length() + 1), insert);
+	double elapsed = Now() - start;
+	done = true;
+	reader.join();
+	Report("snapshot-under-edit", documentSize, ops, elapsed, PoolAllocations() - allocationsBefore);
+	printf("%-22s %9s %12lld snapshot scans\n", "", "", reads.load());
+}
+
+static void RunSuite(int documentSize, long long ops)
+{
+	RandomInsertRemove(documentSize, ops);
+	AppendHeavy(documentSize, ops);
+	SequentialScan(documentSize);
+	ToStringBench(documentSize);
+	SliceBench(documentSize, ops);
+	SnapshotUnderEdit(documentSize, ops < 20000 ? ops : 20000);
+}
+
+int main(int argc, char** argv)
+{
+	bool large = argc > 1 && string(argv[1]) == "--large";
+	srand(12345);
+	printf("block size: %d chars\n", BLOCK_SIZE);
+	printf("== 1KB document ==\n");
+	RunSuite(1 << 10, 200000);
+	printf("== 1MB document ==\n");
+	RunSuite(1 << 20, 200000);
+	if (large) {
+		printf("== 100MB document ==\n");
+		RunSuite(100 << 20, 2000);
+	}
+#ifdef IMMUTABLE_TEXT_STATS
+	TextStats stats = TextStats::Capture();
+	printf("== telemetry ==\n");
+	printf("concat calls: %lld (%lld leaf merges), NodeOf calls: %lld\n",
+		stats.concatCalls, stats.leafMerges, stats.nodeOfCalls);
+	printf("full rebuilds: %lld, rebalances: %lld\n", stats.fullRebuilds, stats.rebalances);
+	printf("FindLeaf: %lld descents, %.1f steps avg, %lld cache hits\n",
+		stats.findLeafDescents,
+		stats.findLeafDescents > 0 ? (double)stats.findLeafSteps / stats.findLeafDescents : 0.0,
+		stats.leafCacheHits);
+	printf("pool: %lld allocs, %lld frees, %lld KB live\n",
+		stats.poolAllocates, stats.poolFrees, stats.bytesLive / 1024);
+#endif
+	return 0;
+}